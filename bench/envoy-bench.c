@@ -0,0 +1,359 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2013
+ */
+
+/* Load generator for envoyd. It starts a private envoyd with the
+ * credential shim preloaded, then forks one client per simulated uid.
+ * Clients stay root but connect with their effective uid switched, which
+ * is all SO_PEERCRED reports, and time every envoy_agent() call. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "lib/envoy.h"
+
+#define FAILED UINT64_MAX
+
+enum mode {
+    MODE_LOOKUP,
+    MODE_COLD,
+    MODE_RESTART
+};
+
+static const char *mode_names[] = {
+    [MODE_LOOKUP]  = "lookup",
+    [MODE_COLD]    = "cold",
+    [MODE_RESTART] = "restart"
+};
+
+static enum mode mode = MODE_LOOKUP;
+static enum agent type = AGENT_SSH_AGENT;
+static size_t clients = 8;
+static size_t requests = 1000;
+static unsigned rate = 0;
+static uid_t first_uid = 100000;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec  = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int as_uid(uid_t uid, struct agent_data_t *data, bool start)
+{
+    if (setegid(uid) < 0 || seteuid(uid) < 0)
+        err(EXIT_FAILURE, "failed to switch to uid=%u", uid);
+
+    int ret = envoy_agent(data, type, start);
+
+    if (seteuid(0) < 0 || setegid(0) < 0)
+        err(EXIT_FAILURE, "failed to switch back to root");
+    return ret;
+}
+
+/* A fresh agent comes back as ENVOY_STARTED, a cached one as ENVOY_RUNNING */
+static bool request(uid_t uid, struct agent_data_t *data)
+{
+    if (as_uid(uid, data, true) < 0)
+        return false;
+    return data->status == ENVOY_STARTED || data->status == ENVOY_RUNNING;
+}
+
+/* Kill the agent, then keep asking until envoyd serves a new one */
+static bool restart(uid_t uid, struct agent_data_t *data)
+{
+    pid_t old = data->pid;
+
+    kill(old, SIGTERM);
+    do {
+        if (!request(uid, data))
+            return false;
+    } while (data->pid == old);
+
+    return true;
+}
+
+static void __attribute__((__noreturn__)) run_client(size_t id, uint64_t *samples)
+{
+    uint64_t interval = rate ? 1000000000 / rate : 0;
+    uid_t uid = first_uid + id;
+    struct agent_data_t data;
+    size_t i;
+
+    if (mode != MODE_COLD && !request(uid, &data))
+        errx(EXIT_FAILURE, "failed to start an agent for uid=%u", uid);
+
+    uint64_t next = now_ns();
+    for (i = 0; i < requests; ++i) {
+        bool ok;
+
+        /* Time from when the request was due, not when it went out, so
+         * a stalled envoyd isn't hidden by the requests it held back */
+        if (interval) {
+            sleep_until(next);
+        } else {
+            next = now_ns();
+        }
+
+        switch (mode) {
+        case MODE_LOOKUP:
+            ok = request(uid, &data);
+            break;
+        case MODE_COLD:
+            ok = request(first_uid + clients + id * requests + i, &data);
+            break;
+        case MODE_RESTART:
+            ok = restart(uid, &data);
+            break;
+        default:
+            ok = false;
+        }
+
+        samples[i] = ok ? now_ns() - next : FAILED;
+        next += interval;
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+static pid_t start_envoyd(const char *envoyd, const char *shim, const char *stub, int threads)
+{
+    char uids[64], jobs[16];
+    struct envoy_stats_t stats;
+    int tries;
+
+    snprintf(uids, sizeof(uids), "%u:%zu", first_uid, clients + clients * requests);
+    snprintf(jobs, sizeof(jobs), "%d", threads);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        err(EXIT_FAILURE, "failed to fork");
+    } else if (pid == 0) {
+        setenv("ENVOY_BENCH_UIDS", uids, true);
+        setenv("ENVOY_BENCH_STUB", stub, true);
+        setenv("LD_PRELOAD", shim, true);
+
+        if (!freopen("/dev/null", "w", stdout))
+            err(EXIT_FAILURE, "failed to silence envoyd");
+
+        execl(envoyd, envoyd, "-t", Agent[type]->name, "-j", jobs, (char *)NULL);
+        err(EXIT_FAILURE, "failed to start %s", envoyd);
+    }
+
+    /* the stats request doubles as a check that envoyd is listening */
+    for (tries = 0; tries < 500; ++tries) {
+        if (envoy_stats(&stats) >= 0)
+            return pid;
+        usleep(10000);
+    }
+
+    kill(pid, SIGTERM);
+    errx(EXIT_FAILURE, "envoyd didn't come up");
+}
+
+static int cmp_samples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(uint64_t *samples, size_t count, uint64_t elapsed)
+{
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    size_t i, ok;
+
+    /* failures sort last, out of the way */
+    qsort(samples, count, sizeof(uint64_t), cmp_samples);
+    for (ok = 0; ok < count && samples[ok] != FAILED; ++ok)
+        ;
+
+    printf("%-8s %zu clients, %zu requests, %zu failed, %.0f req/s\n",
+           mode_names[mode], clients, count, count - ok, count * 1e9 / elapsed);
+    if (!ok)
+        return;
+
+    for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+        size_t n = quantiles[i] * ok;
+        printf("  p%-5g %10.1f us\n", quantiles[i] * 100,
+               samples[n < ok ? n : ok - 1] / 1000.0);
+    }
+    printf("  max    %10.1f us\n", samples[ok - 1] / 1000.0);
+}
+
+static void __attribute__((__noreturn__)) usage(FILE *out)
+{
+    fprintf(out, "usage: %s [options]\n", program_invocation_short_name);
+    fputs("Options:\n"
+        " -h, --help            display this help\n"
+        " -m, --mode=MODE       lookup, cold or restart\n"
+        " -t, --agent=AGENT     the agent to start\n"
+        " -c, --clients=N       number of uids to simulate\n"
+        " -n, --requests=N      requests sent by each client\n"
+        " -r, --rate=N          requests per second per client\n"
+        " -u, --uid=UID         the first uid to simulate\n"
+        " -j, --threads=N       envoyd worker threads\n"
+        " -d, --envoyd=PATH     envoyd to benchmark\n"
+        " -s, --stub=PATH       the stub agent\n"
+        " -p, --shim=PATH       the credential shim\n", out);
+
+    exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *envoyd = "./envoyd", *stub = "./bench/stub-agent", *shim = "./bench/shim.so";
+    char socket[64];
+    int threads = 1, stat;
+    size_t i;
+
+    static const struct option opts[] = {
+        { "help",     no_argument,       0, 'h' },
+        { "mode",     required_argument, 0, 'm' },
+        { "agent",    required_argument, 0, 't' },
+        { "clients",  required_argument, 0, 'c' },
+        { "requests", required_argument, 0, 'n' },
+        { "rate",     required_argument, 0, 'r' },
+        { "uid",      required_argument, 0, 'u' },
+        { "threads",  required_argument, 0, 'j' },
+        { "envoyd",   required_argument, 0, 'd' },
+        { "stub",     required_argument, 0, 's' },
+        { "shim",     required_argument, 0, 'p' },
+        { 0, 0, 0, 0 }
+    };
+
+    while (true) {
+        int opt = getopt_long(argc, argv, "hm:t:c:n:r:u:j:d:s:p:", opts, NULL);
+        if (opt == -1)
+            break;
+
+        switch (opt) {
+        case 'h':
+            usage(stdout);
+            break;
+        case 'm':
+            for (i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); ++i)
+                if (strcmp(optarg, mode_names[i]) == 0)
+                    break;
+            if (i == sizeof(mode_names) / sizeof(mode_names[0]))
+                errx(EXIT_FAILURE, "unknown mode: %s", optarg);
+            mode = i;
+            break;
+        case 't':
+            type = lookup_agent(optarg);
+            if (type == AGENT_MAX)
+                errx(EXIT_FAILURE, "unknown agent: %s", optarg);
+            break;
+        case 'c':
+            clients = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            requests = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            first_uid = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            envoyd = optarg;
+            break;
+        case 's':
+            stub = optarg;
+            break;
+        case 'p':
+            shim = optarg;
+            break;
+        default:
+            usage(stderr);
+        }
+    }
+
+    if (geteuid() != 0)
+        errx(EXIT_FAILURE, "needs to run as root to simulate other users");
+    if (!clients || !requests || threads < 1)
+        errx(EXIT_FAILURE, "nothing to do");
+
+    /* a socket of our own, so a running envoyd isn't disturbed */
+    snprintf(socket, sizeof(socket), "@/envoy-bench/%d", getpid());
+    setenv("ENVOY_SOCKET", socket, true);
+
+    uint64_t *samples = mmap(NULL, clients * requests * sizeof(uint64_t),
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED)
+        err(EXIT_FAILURE, "failed to allocate samples");
+    memset(samples, 0xff, clients * requests * sizeof(uint64_t));
+
+    pid_t *pids = calloc(clients, sizeof(pid_t));
+    if (!pids)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    pid_t daemon = start_envoyd(envoyd, shim, stub, threads);
+    uint64_t start = now_ns();
+
+    for (i = 0; i < clients; ++i) {
+        pids[i] = fork();
+        if (pids[i] < 0)
+            err(EXIT_FAILURE, "failed to fork");
+        else if (pids[i] == 0)
+            run_client(i, &samples[i * requests]);
+    }
+
+    for (i = 0; i < clients; ++i) {
+        if (waitpid(pids[i], &stat, 0) < 0)
+            err(EXIT_FAILURE, "failed to wait on clients");
+        if (!WIFEXITED(stat) || WEXITSTATUS(stat) != 0)
+            warnx("a client failed, its unsent requests count as failures");
+    }
+
+    uint64_t elapsed = now_ns() - start;
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+
+    report(samples, clients * requests, elapsed);
+    return 0;
+}
+
+// vim: et:sts=4:sw=4:cino=(0
@@ -0,0 +1,380 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2013
+ */
+
+/* Throughput of the gpg-protocol parsers. A thread plays gpg-agent on
+ * a private socket and answers with canned transcripts: KEYINFO listings
+ * of various sizes, recorded listings given on the command line, and
+ * replies to batches of queued commands, a quarter of them long ERRs. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "lib/gpg-protocol.h"
+
+#define BATCH 256
+#define MIN_RUNTIME 500000000
+
+struct buffer_t {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static const char *replies[] = {
+    "OK\n",
+    "S PINENTRY_LAUNCHED 4242 curses 1.2.1 - xterm-256color :0 - 1000/1000 0\nOK\n",
+    "# Assuan comments are allowed before a reply\nOK\n",
+    "ERR 67108881 No data <GPG Agent> - the passphrase cache for this key is empty, "
+        "and the agent was told not to ask for it, so it gives up on the preset: "
+        "allow-preset-passphrase might be missing from gpg-agent.conf, or the key "
+        "might live on a smartcard that isn't currently inserted into any reader\n"
+};
+
+static struct buffer_t keyinfo;
+static struct sockaddr_un sa = { .sun_family = AF_UNIX };
+static int server_fd;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void buffer_append(struct buffer_t *buf, const char *data, size_t len)
+{
+    if (buf->len + len > buf->size) {
+        size_t size = 2 * (buf->len + len);
+        char *p = realloc(buf->data, size);
+        if (!p)
+            err(EXIT_FAILURE, "failed to allocate memory");
+
+        buf->data = p;
+        buf->size = size;
+    }
+
+    memcpy(&buf->data[buf->len], data, len);
+    buf->len += len;
+}
+
+static void buffer_printf(struct buffer_t *buf, const char *fmt, ...) __attribute__((format (printf, 2, 3)));
+
+static void buffer_printf(struct buffer_t *buf, const char *fmt, ...)
+{
+    char line[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    buffer_append(buf, line, len);
+}
+
+/* A listing that looks like a smartcard-heavy user's: every other key
+ * sits on a token, and the optional columns are filled in at random */
+static void generate_keyinfo(struct buffer_t *buf, size_t count)
+{
+    static const char protection[] = "PC-";
+    static const char *flags[] = { "-", "S", "Dc", "Sc" };
+    uint32_t seed = 0x5eed;
+    size_t i, j;
+
+    buf->len = 0;
+    for (i = 0; i < count; ++i) {
+        char keygrip[41];
+        bool token = i % 2;
+
+        for (j = 0; j < 40; ++j) {
+            seed = seed * 1103515245 + 12345;
+            keygrip[j] = "0123456789ABCDEF"[(seed >> 16) & 0xf];
+        }
+        keygrip[40] = '\0';
+
+        buffer_printf(buf, "S KEYINFO %s %c %s %s %c %c %s %s %s\n", keygrip,
+                      token ? 'T' : 'D',
+                      token ? "D2760001240102010006012345670000" : "-",
+                      token ? "OPENPGP.1" : "-",
+                      seed & 0x100 ? '1' : '-',
+                      protection[(seed >> 9) % 3],
+                      seed & 0x800 ? "SHA256:Kb6sEJk8VC0x5m+Y8stGOMAR3mcGZ/2H2TCqfl4C0ZM" : "-",
+                      seed & 0x1000 ? "7200" : "-",
+                      flags[(seed >> 13) & 3]);
+    }
+
+    buffer_append(buf, "OK\n", 3);
+}
+
+static void load_transcript(struct buffer_t *buf, const char *path)
+{
+    char chunk[BUFSIZ];
+    ssize_t nbytes_r;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        err(EXIT_FAILURE, "failed to open %s", path);
+
+    buf->len = 0;
+    while ((nbytes_r = read(fd, chunk, sizeof(chunk))) > 0)
+        buffer_append(buf, chunk, nbytes_r);
+    if (nbytes_r < 0)
+        err(EXIT_FAILURE, "failed to read %s", path);
+    close(fd);
+
+    /* a recording of just the status lines still needs its reply */
+    if (buf->len < 3 || memcmp(&buf->data[buf->len - 3], "OK\n", 3) != 0)
+        buffer_append(buf, "OK\n", 3);
+}
+
+static size_t count_keys(const struct buffer_t *buf)
+{
+    const char *p = buf->data, *end = buf->data + buf->len;
+    size_t count = 0;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl)
+            break;
+
+        if (nl - p > 10 && memcmp(p, "S KEYINFO ", 10) == 0)
+            ++count;
+        p = nl + 1;
+    }
+
+    return count;
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t nbytes_w = write(fd, data, len);
+        if (nbytes_w < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        data += nbytes_w;
+        len -= nbytes_w;
+    }
+
+    return true;
+}
+
+/* Answer every command that arrived in one read with a single write */
+static void serve(int fd)
+{
+    struct buffer_t out = { .data = NULL };
+    char in[BUFSIZ];
+    size_t len = 0, nreplies = 0;
+
+    if (!write_all(fd, "OK Pleased to meet you\n", 23))
+        return;
+
+    while (true) {
+        ssize_t nbytes_r = read(fd, &in[len], sizeof(in) - len);
+        if (nbytes_r <= 0)
+            break;
+        len += nbytes_r;
+
+        char *p = in, *nl;
+        out.len = 0;
+        while ((nl = memchr(p, '\n', &in[len] - p))) {
+            if (strncmp(p, "KEYINFO", 7) == 0) {
+                buffer_append(&out, keyinfo.data, keyinfo.len);
+            } else {
+                const char *reply = replies[nreplies++ % (sizeof(replies) / sizeof(replies[0]))];
+                buffer_append(&out, reply, strlen(reply));
+            }
+            p = nl + 1;
+        }
+
+        len = &in[len] - p;
+        memmove(in, p, len);
+
+        if (!write_all(fd, out.data, out.len))
+            break;
+    }
+
+    free(out.data);
+}
+
+static void *agent_thread(void *arg)
+{
+    (void)arg;
+
+    while (true) {
+        int fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            err(EXIT_FAILURE, "failed to accept connection");
+        }
+
+        serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static struct gpg_t *connect_agent(void)
+{
+    char info[sizeof(sa.sun_path) + 16];
+
+    snprintf(info, sizeof(info), "%s:%d:1", sa.sun_path, getpid());
+    struct gpg_t *gpg = gpg_agent_connection(info);
+    if (!gpg)
+        errx(EXIT_FAILURE, "failed to connect to the fake gpg-agent");
+    return gpg;
+}
+
+static void report(const char *name, size_t items, const char *unit, size_t bytes,
+                   uint64_t elapsed)
+{
+    printf("%-24s %10.0f %s/s %8.1f MB/s %8.1f ns/%s\n", name,
+           items * 1e9 / elapsed, unit, bytes * 1e3 / elapsed,
+           (double)elapsed / items, unit);
+}
+
+/* The error action complains about every ERR, keep that out of the way */
+static int quiet(void)
+{
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if (saved < 0 || null < 0 || dup2(null, STDERR_FILENO) < 0)
+        err(EXIT_FAILURE, "failed to silence stderr");
+    close(null);
+    return saved;
+}
+
+static void restore(int saved)
+{
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+}
+
+static void bench_keyinfo(const char *name)
+{
+    size_t expected = count_keys(&keyinfo), iterations = 0, count;
+    struct gpg_t *gpg = connect_agent();
+    uint64_t start = now_ns(), elapsed;
+
+    do {
+        gpg_keyinfo(gpg, &count);
+        if (count != expected)
+            errx(EXIT_FAILURE, "%s: parsed %zu keys, expected %zu", name, count, expected);
+        ++iterations;
+    } while ((elapsed = now_ns() - start) < MIN_RUNTIME);
+
+    gpg_close(gpg);
+    report(name, iterations * (expected ? expected : 1), expected ? "key" : "list",
+           iterations * keyinfo.len, elapsed);
+}
+
+static void bench_replies(void)
+{
+    struct gpg_t *gpg = connect_agent();
+    size_t nreplies = sizeof(replies) / sizeof(replies[0]);
+    size_t iterations = 0, bytes = 0, i;
+    uint64_t start = now_ns(), elapsed;
+    int results[BATCH];
+
+    for (i = 0; i < nreplies; ++i)
+        bytes += strlen(replies[i]);
+    bytes *= BATCH / nreplies;
+
+    int saved = quiet();
+    do {
+        for (i = 0; i < BATCH; ++i)
+            gpg_queue(gpg, "NOP\n");
+
+        /* one in every nreplies is an ERR */
+        int failed = gpg_flush(gpg, results);
+        if (failed != BATCH / (int)nreplies) {
+            restore(saved);
+            errx(EXIT_FAILURE, "replies: %d commands failed, expected %zu", failed,
+                 BATCH / nreplies);
+        }
+        ++iterations;
+    } while ((elapsed = now_ns() - start) < MIN_RUNTIME);
+    restore(saved);
+
+    gpg_close(gpg);
+    report("replies", iterations * BATCH, "reply", iterations * bytes, elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = { 1, 16, 256, 1024 };
+    char dir[] = "/tmp/gpg-bench-XXXXXX";
+    pthread_t thread;
+    size_t i;
+    int j;
+
+    if (!mkdtemp(dir))
+        err(EXIT_FAILURE, "failed to create socket directory");
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/S.gpg-agent", dir);
+
+    server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_fd < 0)
+        err(EXIT_FAILURE, "failed to create socket");
+    if (bind(server_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(server_fd, 1) < 0)
+        err(EXIT_FAILURE, "failed to bind %s", sa.sun_path);
+
+    /* the server only ever reads keyinfo between our requests */
+    errno = pthread_create(&thread, NULL, agent_thread, NULL);
+    if (errno)
+        err(EXIT_FAILURE, "failed to start the fake gpg-agent");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "keyinfo %zu keys", sizes[i]);
+        generate_keyinfo(&keyinfo, sizes[i]);
+        bench_keyinfo(name);
+    }
+
+    for (j = 1; j < argc; ++j) {
+        load_transcript(&keyinfo, argv[j]);
+        bench_keyinfo(argv[j]);
+    }
+
+    bench_replies();
+
+    unlink(sa.sun_path);
+    rmdir(dir);
+    free(keyinfo.data);
+    return 0;
+}
+
+// vim: et:sts=4:sw=4:cino=(0
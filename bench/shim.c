@@ -0,0 +1,91 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2013
+ */
+
+/* Preloaded into envoyd by envoy-bench. It makes up passwd entries for
+ * the range of uids the benchmark connects as, and runs the stub agent
+ * in place of the real ones. ENVOY_BENCH_UIDS is "first:count", and
+ * ENVOY_BENCH_STUB the stub's path. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pwd.h>
+#include <unistd.h>
+
+static uid_t first_uid;
+static uid_t uid_count;
+static int stub_fd = -1;
+
+static void __attribute__((constructor)) shim_init(void)
+{
+    const char *uids = getenv("ENVOY_BENCH_UIDS");
+    const char *stub = getenv("ENVOY_BENCH_STUB");
+
+    if (uids)
+        sscanf(uids, "%u:%u", &first_uid, &uid_count);
+
+    /* Opened now, as root: the agent is exec'd after dropping to the
+     * bench uid, which may not be able to reach the build directory */
+    if (stub)
+        stub_fd = open(stub, O_PATH | O_CLOEXEC);
+}
+
+int getpwuid_r(uid_t uid, struct passwd *pwd, char *buf, size_t buflen, struct passwd **result)
+{
+    static int (*real)(uid_t, struct passwd *, char *, size_t, struct passwd **);
+
+    if (uid < first_uid || uid - first_uid >= uid_count) {
+        if (!real)
+            *(void **)&real = dlsym(RTLD_NEXT, "getpwuid_r");
+        return real(uid, pwd, buf, buflen, result);
+    }
+
+    int len = snprintf(buf, buflen, "envoy-bench-%u", uid);
+    if (len < 0 || (size_t)len + sizeof("/tmp") + 1 > buflen) {
+        *result = NULL;
+        return ERANGE;
+    }
+
+    *pwd = (struct passwd){
+        .pw_name  = buf,
+        .pw_uid   = uid,
+        .pw_gid   = uid,
+        .pw_dir   = strcpy(buf + len + 1, "/tmp"),
+        .pw_shell = "/bin/sh"
+    };
+
+    *result = pwd;
+    return 0;
+}
+
+int execve(const char *path, char *const argv[], char *const envp[])
+{
+    static int (*real)(const char *, char *const [], char *const []);
+
+    if (stub_fd >= 0 && (strcmp(path, "/usr/bin/ssh-agent") == 0 ||
+                         strcmp(path, "/usr/bin/gpg-agent") == 0))
+        return fexecve(stub_fd, argv, envp);
+
+    if (!real)
+        *(void **)&real = dlsym(RTLD_NEXT, "execve");
+    return real(path, argv, envp);
+}
+
+// vim: et:sts=4:sw=4:cino=(0
@@ -0,0 +1,94 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2013
+ */
+
+/* Stands in for ssh-agent and gpg-agent when benchmarking envoyd. It
+ * daemonizes and prints its environment the same way the real agents
+ * do, but otherwise just hangs up on anyone who connects, so starting
+ * one costs about as little as a process can. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static char dir[] = "/tmp/envoy-stub-XXXXXX";
+static struct sockaddr_un sa = { .sun_family = AF_UNIX };
+
+static void sighandler(int signum)
+{
+    (void)signum;
+
+    unlink(sa.sun_path);
+    rmdir(dir);
+    _exit(EXIT_SUCCESS);
+}
+
+static void __attribute__((__noreturn__)) serve(int fd)
+{
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+
+    /* let envoyd see EOF on our output */
+    if (null < 0 || dup2(null, STDIN_FILENO) < 0 || dup2(null, STDOUT_FILENO) < 0 ||
+        dup2(null, STDERR_FILENO) < 0)
+        err(EXIT_FAILURE, "failed to detach from envoyd");
+
+    setsid();
+    signal(SIGTERM, sighandler);
+    signal(SIGHUP, SIG_IGN);
+
+    while (true) {
+        int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd >= 0)
+            close(cfd);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool gpg = argc > 0 && strstr(argv[0], "gpg-agent");
+
+    if (!mkdtemp(dir))
+        err(EXIT_FAILURE, "failed to create socket directory");
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/%s", dir, gpg ? "S.gpg-agent" : "agent");
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        err(EXIT_FAILURE, "failed to create socket");
+
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, SOMAXCONN) < 0)
+        err(EXIT_FAILURE, "failed to bind %s", sa.sun_path);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        err(EXIT_FAILURE, "failed to fork");
+    else if (pid == 0)
+        serve(fd);
+
+    if (gpg)
+        printf("GPG_AGENT_INFO=%s:%d:1; export GPG_AGENT_INFO;\n", sa.sun_path, pid);
+    printf("SSH_AUTH_SOCK=%s; export SSH_AUTH_SOCK;\n", sa.sun_path);
+    printf("SSH_AGENT_PID=%d; export SSH_AGENT_PID;\n", pid);
+    return 0;
+}
+
+// vim: et:sts=4:sw=4:cino=(0
@@ -29,8 +29,12 @@ static const char *exe_path;
 static int get_agent(struct agent_data_t *data, enum agent id, bool start)
 {
     int ret = envoy_agent(data, id, start);
-    if (ret < 0)
+    if (ret == -ETIMEDOUT) {
+        errx(EXIT_FAILURE, "timed out waiting for envoyd");
+    } else if (ret < 0) {
+        errno = -ret;
         err(EXIT_FAILURE, "failed to fetch agent");
+    }
 
     switch (data->status) {
     case ENVOY_STOPPED:
@@ -41,6 +45,8 @@ static int get_agent(struct agent_data_t *data, enum agent id, bool start)
         errx(EXIT_FAILURE, "agent failed to start, check envoyd's log");
     case ENVOY_BADUSER:
         errx(EXIT_FAILURE, "connection rejected, user is unauthorized to use this agent");
+    case ENVOY_BADCONFIG:
+        errx(EXIT_FAILURE, "agent definitions differ from envoyd's, restart it after changing agents.conf");
     }
 
     return ret;
@@ -48,10 +54,14 @@ static int get_agent(struct agent_data_t *data, enum agent id, bool start)
 
 static void source_env(struct agent_data_t *data)
 {
-    if (data->type == AGENT_GPG_AGENT) {
+    /* gpg-agent 2.1 and later print no GPG_AGENT_INFO */
+    if (data->type == AGENT_GPG_AGENT && data->gpg[0]) {
         struct gpg_t *agent = gpg_agent_connection(data->gpg);
-        gpg_update_tty(agent);
-        gpg_close(agent);
+
+        if (agent) {
+            gpg_update_tty(agent, data->home);
+            gpg_close(agent);
+        }
 
         setenv("GPG_AGENT_INFO", data->gpg, true);
     }
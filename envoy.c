@@ -19,18 +19,23 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <string.h>
 #include <getopt.h>
 #include <err.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <pwd.h>
+#include <signal.h>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #include "lib/envoy.h"
 #include "lib/gpg-protocol.h"
+#include "lib/ssh-protocol.h"
 
 static struct termios old_termios;
 
@@ -43,6 +48,7 @@ enum action {
     ACTION_KILL,
     ACTION_LIST,
     ACTION_UNLOCK,
+    ACTION_STATS,
     ACTION_INVALID
 };
 
@@ -82,12 +88,8 @@ static ssize_t read_password(char **password)
     return nbytes_r;
 }
 
-static int get_agent(struct agent_data_t *data, enum agent id, bool start)
+static void check_agent(const struct agent_data_t *data)
 {
-    int ret = envoy_agent(data, id, start);
-    if (ret < 0)
-        err(EXIT_FAILURE, "failed to fetch agent");
-
     switch (data->status) {
     case ENVOY_STOPPED:
     case ENVOY_STARTED:
@@ -97,8 +99,40 @@ static int get_agent(struct agent_data_t *data, enum agent id, bool start)
         errx(EXIT_FAILURE, "agent failed to start, check envoyd's log");
     case ENVOY_BADUSER:
         errx(EXIT_FAILURE, "connection rejected, user is unauthorized to use this agent");
+    case ENVOY_BADCONFIG:
+        errx(EXIT_FAILURE, "agent definitions differ from envoyd's, restart it after changing agents.conf");
     }
+}
 
+static void check_reply(int ret)
+{
+    if (ret == -ETIMEDOUT) {
+        errx(EXIT_FAILURE, "timed out waiting for envoyd");
+    } else if (ret < 0) {
+        errno = -ret;
+        err(EXIT_FAILURE, "failed to fetch agent");
+    }
+}
+
+static int get_agent(struct agent_data_t *data, enum agent id, bool start)
+{
+    int ret = envoy_agent(data, id, start);
+
+    check_reply(ret);
+    check_agent(data);
+    return ret;
+}
+
+/* data is indexed by agent type */
+static int get_agents(struct agent_data_t *data, unsigned mask, bool start)
+{
+    enum agent id;
+    int ret = envoy_agents(data, mask, start);
+
+    check_reply(ret);
+    for (id = 0; id < agent_count; ++id)
+        if (mask & ENVOY_AGENT_BIT(id))
+            check_agent(&data[id]);
     return ret;
 }
 
@@ -115,53 +149,374 @@ static char *get_key_path(const char *home, const char *fragment)
     return out;
 }
 
-static void __attribute__((__noreturn__)) add_keys(char **keys, int count)
+static bool key_loaded(const struct ssh_identities_t *ids, const char *key)
+{
+    unsigned char *blob;
+    size_t len;
+    char *pub;
+    bool loaded = false;
+
+    safe_asprintf(&pub, "%s.pub", key);
+    if (ssh_load_pubkey(pub, &blob, &len) == 0) {
+        loaded = ssh_has_identity(ids, blob, len);
+        free(blob);
+    }
+
+    free(pub);
+    return loaded;
+}
+
+/* With skip_loaded, only the keys that aren't loaded yet are handed to
+ * ssh-add; if the agent can't be asked, ssh-add gets to sort it out.
+ * Without any keys, ssh-add picks its own defaults. */
+static void add_keys(const struct agent_data_t *data, char **keys, int count,
+                     bool skip_loaded)
 {
     /* command + end-of-opts + NULL + keys */
     char *args[count + 3];
-    struct passwd *pwd;
-    int i;
-
-    pwd = getpwuid(getuid());
-    if (pwd == NULL || pwd->pw_dir == NULL)
-        err(EXIT_FAILURE, "failed to lookup passwd entry");
+    struct ssh_identities_t ids = { .count = 0 };
+    const char *home = data->home;
+    int i, argc = 2;
+
+    /* envoyd normally tells us, unless it's an older one */
+    if (!home[0]) {
+        struct passwd *pwd = getpwuid(getuid());
+        if (pwd == NULL || pwd->pw_dir == NULL)
+            err(EXIT_FAILURE, "failed to lookup passwd entry");
+        home = pwd->pw_dir;
+    }
 
     args[0] = "/usr/bin/ssh-add";
     args[1] = "--";
 
-    for (i = 0; i < count; i++)
-        args[2 + i] = get_key_path(pwd->pw_dir, keys[i]);
+    if (skip_loaded && count && ssh_list_identities(data->sock, &ids) < 0)
+        ids = (struct ssh_identities_t){ .count = 0 };
+
+    for (i = 0; i < count; i++) {
+        char *path = get_key_path(home, keys[i]);
+
+        if (skip_loaded && key_loaded(&ids, path)) {
+            free(path);
+            continue;
+        }
+
+        args[argc++] = path;
+    }
+
+    args[argc] = NULL;
+    ssh_free_identities(&ids);
 
-    args[2 + count] = NULL;
+    /* every key asked for is already there */
+    if (count && argc == 2)
+        return;
 
     execv(args[0], args);
     err(EXIT_FAILURE, "failed to launch ssh-add");
 }
 
-static void print_sh_env(struct agent_data_t *data)
+static int list_keys(const char *sock)
 {
+    struct ssh_identities_t ids;
+    size_t i;
+
+    int rc = ssh_list_identities(sock, &ids);
+    if (rc < 0) {
+        errno = -rc;
+        err(EXIT_FAILURE, "failed to list identities");
+    }
+
+    if (ids.count == 0) {
+        puts("The agent has no identities.");
+        return 1;
+    }
+
+    for (i = 0; i < ids.count; ++i) {
+        const struct ssh_identity_t *key = &ids.keys[i];
+        char fingerprint[SSH_FINGERPRINT_LEN + 1];
+        const char *type;
+
+        int bits = ssh_key_bits(key->blob, key->blob_len, &type);
+        ssh_fingerprint(key->blob, key->blob_len, fingerprint);
+
+        printf("%d %s %.*s (%s)\n", bits, fingerprint,
+               (int)key->comment_len, key->comment, type);
+    }
+
+    ssh_free_identities(&ids);
+    return 0;
+}
+
+/* Through a pidfd where the kernel has them, so the only moment a
+ * recycled pid could be hit is while it's being opened */
+static void signal_agent(const struct agent_data_t *data, int signal)
+{
+    int rc, pidfd = syscall(SYS_pidfd_open, data->pid, 0);
+
+    if (pidfd >= 0) {
+        rc = syscall(SYS_pidfd_send_signal, pidfd, signal, NULL, 0);
+        close(pidfd);
+    } else if (errno == ENOSYS) {
+        rc = kill(data->pid, signal);
+    } else {
+        rc = -1;
+    }
+
+    if (rc < 0)
+        warn("failed to signal %s pid=%d", Agent[data->type]->name, data->pid);
+}
+
+/* envoy --eval-cache keeps the environment here for rc files to source,
+ * one copy per login session when logind names it */
+#define ENV_CACHE_PATH "/run/user/%u/envoy-env%s%s.%s"
+#define ENV_SESSION_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-"
+
+struct env_t {
+    size_t len;
+    size_t size;
+    char *buf;
+};
+
+static void env_append(struct env_t *env, const char *data, size_t len)
+{
+    if (len > env->size - env->len) {
+        size_t size = 2 * (env->len + len);
+        if (size < 512)
+            size = 512;
+
+        char *buf = realloc(env->buf, size);
+        if (!buf)
+            err(EXIT_FAILURE, "failed to allocate memory");
+
+        env->buf = buf;
+        env->size = size;
+    }
+
+    memcpy(&env->buf[env->len], data, len);
+    env->len += len;
+}
+
+static void env_puts(struct env_t *env, const char *str)
+{
+    env_append(env, str, strlen(str));
+}
+
+/* Single quote a value. sh has no escapes inside single quotes, so a
+ * quote closes the string, adds an escaped quote and reopens it. fish
+ * takes \' and \\ inside them instead. */
+static void env_quote(struct env_t *env, const char *value, bool fish)
+{
+    const char *p;
+
+    env_append(env, "'", 1);
+    for (p = value; *p; ++p) {
+        if (*p == '\'')
+            env_puts(env, fish ? "\\'" : "'\\''");
+        else if (*p == '\\' && fish)
+            env_puts(env, "\\\\");
+        else
+            env_append(env, p, 1);
+    }
+    env_append(env, "'", 1);
+}
+
+static void env_set(struct env_t *env, const char *name, const char *value, bool fish)
+{
+    env_puts(env, fish ? "set -x " : "export ");
+    env_puts(env, name);
+    env_puts(env, fish ? " " : "=");
+    env_quote(env, value, fish);
+    env_puts(env, fish ? ";" : "\n");
+}
+
+static void env_unset(struct env_t *env, const char *name, bool fish)
+{
+    env_puts(env, fish ? "set -e " : "unset ");
+    env_puts(env, name);
+    env_puts(env, fish ? ";" : "\n");
+}
+
+/* The whole snippet goes out in one write, ahead of anything ssh-add
+ * might print once it's exec'd */
+static void env_write(const struct env_t *env, int fd)
+{
+    size_t off = 0;
+
+    while (off < env->len) {
+        ssize_t nbytes_w = write(fd, &env->buf[off], env->len - off);
+        if (nbytes_w < 0) {
+            if (errno == EINTR)
+                continue;
+            err(EXIT_FAILURE, "failed to write environment");
+        }
+        off += nbytes_w;
+    }
+}
+
+static void env_flush(struct env_t *env, int fd)
+{
+    env_write(env, fd);
+    env->len = 0;
+}
+
+static void append_env(struct env_t *env, const struct agent_data_t *data, bool fish)
+{
+    char pid[16];
+
     if (data->type == AGENT_GPG_AGENT)
-        printf("export GPG_AGENT_INFO='%s'\n", data->gpg);
+        env_set(env, "GPG_AGENT_INFO", data->gpg, fish);
+
+    env_set(env, "SSH_AUTH_SOCK", data->sock, fish);
 
-    printf("export SSH_AUTH_SOCK='%s'\n", data->sock);
-    printf("export SSH_AGENT_PID='%d'\n", data->pid);
+    /* gpg-agent 2.1 and later don't tell us their pid */
+    if (data->pid) {
+        snprintf(pid, sizeof(pid), "%d", data->pid);
+        env_set(env, "SSH_AGENT_PID", pid, fish);
+    } else {
+        env_unset(env, "SSH_AGENT_PID", fish);
+    }
 }
 
-static void print_fish_env(struct agent_data_t *data)
+static void append_unset(struct env_t *env, const struct agent_data_t *data, bool fish)
 {
     if (data->type == AGENT_GPG_AGENT)
-        printf("set -x GPG_AGENT_INFO '%s';", data->gpg);
+        env_unset(env, "GPG_AGENT_INFO", fish);
+
+    if (fish) {
+        env_unset(env, "SSH_AUTH_SOCK", fish);
+        env_unset(env, "SSH_AGENT_PID", fish);
+    } else {
+        env_unset(env, "SSH_AUTH_SOCK SSH_AGENT_PID", fish);
+    }
+}
+
+/* The cached copy only applies itself while every agent's socket is
+ * still around, and fails otherwise, so rc files can fall back on
+ * asking envoy:
+ *
+ *     . "$XDG_RUNTIME_DIR/envoy-env${XDG_SESSION_ID:+-$XDG_SESSION_ID}.sh" 2>/dev/null ||
+ *         eval "$(envoy -e -p)"
+ *
+ * Nothing is cached when no agent is running. exports holds what's
+ * printed, the same variables go in the cache. */
+static void write_env_cache(const struct agent_data_t **agents, size_t count,
+                            const struct env_t *exports, bool fish)
+{
+    struct env_t env = { .len = 0 };
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    size_t i;
+
+    /* it ends up in a path, so it's only used if it's a plain name */
+    const char *session = getenv("XDG_SESSION_ID");
+    if (!session || !*session || strspn(session, ENV_SESSION_CHARS) != strlen(session))
+        session = "";
+
+    snprintf(path, sizeof(path), ENV_CACHE_PATH, getuid(),
+             session[0] ? "-" : "", session, fish ? "fish" : "sh");
+    if (!count) {
+        unlink(path);
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        env_puts(&env, fish ? "test -S " : "[ -S ");
+        env_quote(&env, agents[i]->sock, fish);
+        env_puts(&env, fish ? "; and " : " ] && ");
+    }
+
+    env_puts(&env, fish ? "begin; " : "{\n");
+
+    /* renamed into place, so a shell never sources half a file */
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        warn("failed to cache environment in %s", path);
+        free(env.buf);
+        return;
+    }
+
+    env_flush(&env, fd);
+    env_write(exports, fd);
+    env_puts(&env, fish ? " end\n" : "}\n");
+    env_flush(&env, fd);
+    free(env.buf);
+
+    if (close(fd) < 0 || rename(tmp, path) < 0) {
+        warn("failed to cache environment in %s", path);
+        unlink(tmp);
+    }
+}
+
+static void print_env(const struct agent_data_t **agents, size_t count, bool fish, bool cache)
+{
+    struct env_t env = { .len = 0 };
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+        append_env(&env, agents[i], fish);
+
+    if (cache)
+        write_env_cache(agents, count, &env, fish);
+
+    env_write(&env, STDOUT_FILENO);
+    free(env.buf);
+}
+
+/* Print the agent's environment every time it changes */
+static int watch(enum agent id, bool fish)
+{
+    struct env_t env = { .len = 0 };
+    struct agent_data_t data;
+    int ret;
+
+    int fd = envoy_watch(id);
+    if (fd < 0) {
+        errno = -fd;
+        err(EXIT_FAILURE, "failed to watch agent");
+    }
+
+    while ((ret = envoy_watch_next(fd, &data)) > 0) {
+        switch (data.status) {
+        case ENVOY_STARTED:
+        case ENVOY_RUNNING:
+            append_env(&env, &data, fish);
+            break;
+        case ENVOY_FAILED:
+            warnx("agent failed to start, check envoyd's log");
+            /* fall through */
+        case ENVOY_STOPPED:
+            append_unset(&env, &data, fish);
+            break;
+        case ENVOY_BADUSER:
+            errx(EXIT_FAILURE, "connection rejected, user is unauthorized to use this agent");
+        case ENVOY_BADCONFIG:
+            errx(EXIT_FAILURE, "agent definitions differ from envoyd's, restart it after changing agents.conf");
+        }
+
+        if (fish)
+            env_puts(&env, "\n");
+        env_flush(&env, STDOUT_FILENO);
+    }
+
+    if (ret < 0) {
+        errno = -ret;
+        err(EXIT_FAILURE, "failed to read from envoyd");
+    }
 
-    printf("set -x SSH_AUTH_SOCK '%s';", data->sock);
-    printf("set -x SSH_AGENT_PID '%d';", data->pid);
+    free(env.buf);
+    close(fd);
+    return 0;
 }
 
-static void source_env(struct agent_data_t *data)
+static void source_env(const struct agent_data_t *data)
 {
-    if (data->type == AGENT_GPG_AGENT) {
+    /* gpg-agent 2.1 and later print no GPG_AGENT_INFO */
+    if (data->type == AGENT_GPG_AGENT && data->gpg[0]) {
         struct gpg_t *agent = gpg_agent_connection(data->gpg);
-        gpg_update_tty(agent);
-        gpg_close(agent);
+
+        if (agent) {
+            gpg_update_tty(agent, data->home);
+            gpg_close(agent);
+        }
     }
 
     setenv("SSH_AUTH_SOCK", data->sock, true);
@@ -176,15 +531,59 @@ static int unlock(const struct agent_data_t *data, char *password)
     if (!password)
         read_password(&password);
 
-    const struct fingerprint_t *fgpt = gpg_keyinfo(agent);
-    for (; fgpt; fgpt = fgpt->next) {
-        if (gpg_preset_passphrase(agent, fgpt->fingerprint, -1, password) < 0) {
-            warnx("failed to unlock key '%s'", fgpt->fingerprint);
-            return 1;
-        }
+    int rc = gpg_preset_passphrase_all(agent, -1, password);
+    gpg_close(agent);
+
+    if (rc < 0) {
+        errno = -rc;
+        warn("failed to unlock keys");
+        return 1;
+    } else if (rc > 0) {
+        warnx("failed to unlock %d key%s", rc, rc > 1 ? "s" : "");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int print_stats(void)
+{
+    struct envoy_stats_t stats;
+    size_t i;
+
+    int ret = envoy_stats(&stats);
+    if (ret == -EPROTONOSUPPORT)
+        errx(EXIT_FAILURE, "envoyd is too old to report stats");
+    else if (ret == -ETIMEDOUT)
+        errx(EXIT_FAILURE, "timed out waiting for envoyd");
+    else if (ret < 0) {
+        errno = -ret;
+        err(EXIT_FAILURE, "failed to get stats from envoyd");
+    }
+
+    for (i = 0; i < ENVOY_COUNTER_MAX; ++i)
+        printf("%-12s %" PRIu64 "\n", envoy_counter_names[i], stats.counters[i]);
+
+    printf("\n%-12s %10s %10s %10s %10s %10s %10s\n", "phase (us)",
+           "count", "mean", "p50", "p90", "p99", "max");
+    for (i = 0; i < ENVOY_PHASE_MAX; ++i) {
+        const struct envoy_timing_t *t = &stats.timings[i];
+        double mean = t->count ? (double)t->sum / t->count : 0;
+
+        printf("%-12s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               envoy_phase_names[i], t->count, mean / 1000, t->p50 / 1000.0,
+               t->p90 / 1000.0, t->p99 / 1000.0, t->max / 1000.0);
+    }
+
+    printf("\n%-12s %10s %12s %12s %12s\n", "agent", "scopes", "memory (KiB)",
+           "largest", "cpu (s)");
+    for (i = 0; i < (size_t)agent_count; ++i) {
+        const struct envoy_usage_t *u = &stats.usage[i];
+
+        printf("%-12s %10" PRIu32 " %12" PRIu64 " %12" PRIu64 " %12.1f\n", Agent[i]->name,
+               u->scopes, u->memory / 1024, u->memory_max / 1024, u->cpu / 1e6);
     }
 
-    gpg_close(agent);
     return 0;
 }
 
@@ -201,18 +600,24 @@ static void __attribute__((__noreturn__)) usage(FILE *out)
         " -u, --unlock=[PASS]   unlock the agent's keyring (gpg-agent only)\n"
         " -p, --print           print out sh environmental arguments\n"
         " -f, --fish            print out fish environmental arguments\n"
-        " -t, --agent=AGENT     set the prefered to start\n", out);
+        " -e, --eval-cache      also cache the environment for rc files\n"
+        " -t, --agent=AGENT     set the prefered to start, repeat for more\n"
+        " -s, --stats           show envoyd's counters and latencies\n"
+        " -w, --watch           print the environment every time it changes\n", out);
 
     exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 int main(int argc, char *argv[])
 {
-    bool source = true;
-    struct agent_data_t data;
+    bool source = true, watching = false, eval_cache = false;
+    struct agent_data_t data, agents[AGENT_MAX];
+    const struct agent_data_t *exported[AGENT_MAX];
+    size_t nexported = 0;
     char *password = NULL;
     enum action verb = ACTION_NONE;
-    enum agent type = AGENT_DEFAULT;
+    enum agent type = AGENT_DEFAULT, id;
+    unsigned others = 0;
 
     static const struct option opts[] = {
         { "help",    no_argument, 0, 'h' },
@@ -224,12 +629,19 @@ int main(int argc, char *argv[])
         { "unlock",  optional_argument, 0, 'u' },
         { "print",   no_argument, 0, 'p' },
         { "fish",    no_argument, 0, 'f' },
+        { "eval-cache", no_argument, 0, 'e' },
         { "agent",   required_argument, 0, 't' },
+        { "stats",   no_argument, 0, 's' },
+        { "watch",   no_argument, 0, 'w' },
         { 0, 0, 0, 0 }
     };
 
+    int rc = load_agents(NULL);
+    if (rc < 0)
+        errx(EXIT_FAILURE, "failed to read agent definitions: %s", strerror(-rc));
+
     while (true) {
-        int opt = getopt_long(argc, argv, "hvakKlu::pft:", opts, NULL);
+        int opt = getopt_long(argc, argv, "hvakKlu::pfet:sw", opts, NULL);
         if (opt == -1)
             break;
 
@@ -264,50 +676,91 @@ int main(int argc, char *argv[])
         case 'f':
             verb = ACTION_FISH_PRINT;
             break;
+        case 'e':
+            eval_cache = true;
+            break;
+        case 's':
+            verb = ACTION_STATS;
+            break;
+        case 'w':
+            watching = true;
+            break;
         case 't':
-            type = lookup_agent(optarg);
-            if (type == LAST_AGENT)
+            id = lookup_agent(optarg);
+            if (id == AGENT_MAX)
                 errx(EXIT_FAILURE, "unknown agent: %s", optarg);
+
+            /* the first agent named is the one acted on */
+            if (type == AGENT_DEFAULT)
+                type = id;
+            else if (id != type)
+                others |= ENVOY_AGENT_BIT(id);
             break;
         default:
             usage(stderr);
         }
     }
 
-    if (get_agent(&data, type, source) < 0)
+    if (eval_cache) {
+        if (verb == ACTION_NONE)
+            verb = ACTION_SH_PRINT;
+        else if (verb != ACTION_SH_PRINT && verb != ACTION_FISH_PRINT)
+            errx(EXIT_FAILURE, "--eval-cache only goes with --print or --fish");
+    }
+
+    if (verb == ACTION_STATS)
+        return print_stats();
+    else if (watching)
+        return watch(type, verb == ACTION_FISH_PRINT);
+
+    if (others) {
+        get_agents(agents, others | ENVOY_AGENT_BIT(type), source);
+        data = agents[type];
+
+        /* the rest go first, so the first agent's SSH_AUTH_SOCK wins */
+        for (id = 0; id < agent_count; ++id)
+            if ((others & ENVOY_AGENT_BIT(id)) && agents[id].status != ENVOY_STOPPED)
+                exported[nexported++] = &agents[id];
+    } else if (get_agent(&data, type, source) < 0) {
         errx(EXIT_FAILURE, "recieved no data, did the agent fail to start?");
+    }
 
-    if (data.status == ENVOY_STOPPED)
-        return 0;
+    if (data.status != ENVOY_STOPPED)
+        exported[nexported++] = &data;
+
+    if (source) {
+        size_t i;
 
-    if (source)
-        source_env(&data);
+        for (i = 0; i < nexported; ++i)
+            source_env(exported[i]);
+    }
 
-    if (verb == ACTION_SH_PRINT)
-        print_sh_env(&data);
-    else if (verb == ACTION_FISH_PRINT)
-        print_fish_env(&data);
+    if (verb == ACTION_SH_PRINT || verb == ACTION_FISH_PRINT)
+        print_env(exported, nexported, verb == ACTION_FISH_PRINT, eval_cache);
+
+    if (data.status == ENVOY_STOPPED)
+        return 0;
 
     switch (verb) {
     case ACTION_NONE:
         if (data.status == ENVOY_RUNNING || data.type == AGENT_GPG_AGENT)
             break;
-        /* fall through */
+        add_keys(&data, &argv[optind], argc - optind, true);
+        break;
     case ACTION_FORCE_ADD:
-        add_keys(&argv[optind], argc - optind);
+        add_keys(&data, &argv[optind], argc - optind, false);
         break;
     case ACTION_CLEAR:
         if (data.type == AGENT_GPG_AGENT)
-            kill(data.pid, SIGHUP);
+            signal_agent(&data, SIGHUP);
         else
             errx(EXIT_FAILURE, "only gpg-agent supports this operation");
         break;
     case ACTION_KILL:
-        kill(data.pid, SIGTERM);
+        signal_agent(&data, SIGTERM);
         break;
     case ACTION_LIST:
-        execlp("ssh-add", "ssh-add", "-l", NULL);
-        err(EXIT_FAILURE, "failed to launch ssh-add");
+        return list_keys(data.sock);
     case ACTION_UNLOCK:
         unlock(&data, password);
         break;
@@ -21,10 +21,22 @@
 #include <string.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <errno.h>
 #include <err.h>
+#include <fcntl.h>
+#include <grp.h>
 #include <pwd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
@@ -32,21 +44,278 @@
 #include <systemd/sd-daemon.h>
 
 #include "lib/envoy.h"
+#include "lib/agent-output.h"
+#include "lib/gpg-protocol.h"
+#include "lib/ssh-protocol.h"
 #include "clique/systemd-unit.h"
 #include "clique/systemd-scope.h"
 
 struct agent_info_t {
     uid_t uid;
+    enum agent type;
+    struct agent_data_t d;
+    struct event_t *watch;
+    int pidfd;
+    struct spawn_t *spawn;
+    struct proxy_t *proxy;
+    struct event_t *probe;
+    pid_t probe_pid;
+    time_t last_used;
+    time_t home_expires;
+    gid_t gid;
+    gid_t *groups;
+    int ngroups;
+    uint64_t start_time;
+};
+
+/* Open addressing hash table of agents, keyed by (uid, agent type).
+ * Removed entries leave a tombstone behind, so deleting while iterating
+ * with registry_next() is safe. Inserting while iterating is not, as it
+ * may trigger a rehash. */
+struct registry_t {
+    struct agent_info_t **slots;
+    size_t size;
+    size_t count;
+    size_t used;
+};
+
+/* Users who want agents holding keys exempt from the idle timeout
+ * create this file */
+#define KEEP_LOADED_PATH "/run/user/%u/envoy-keep-loaded"
+
+/* How long a resolved home directory, gid and groups are trusted,
+ * nscd's default for passwd entries */
+#define HOME_TTL 600
+
+/* With --proxy, where each user's agents can also be reached, and how
+ * long to wait before trying again when one can't be set up */
+#define PROXY_PATH  "/run/user/%u/envoy-%s"
+#define PROXY_RETRY 60
+#define RELAY_CHUNK 65536
+
+/* How long to go without systemd after failing to reach it, before
+ * trying to connect again */
+#define BUS_RETRY 5
+
+/* How long agents get, all together, to exit when envoyd does before
+ * whatever is left of them is killed */
+#define STOP_TIMEOUT_MS 5000
+
+/* How long an idle agent gets to list its keys before it's reaped */
+#define PROBE_TIMEOUT 5
+
+/* How deep into the cgroup tree to look for our scopes when reporting
+ * their usage. A user manager's app.slice is four levels down. */
+#define SCOPE_SEARCH_DEPTH 8
+
+/* The scope properties --limit can set, and the cgroup files they're
+ * written to */
+enum limit {
+    LIMIT_MEMORY,
+    LIMIT_CPU,
+    LIMIT_TASKS,
+    LIMIT_IO,
+    LIMIT_MAX
+};
+
+static const struct {
+    const char *property;
+    const char *file;
+} Limit[LIMIT_MAX] = {
+    [LIMIT_MEMORY] = { "MemoryMax", "memory.max" },
+    [LIMIT_CPU]    = { "CPUWeight", "cpu.weight" },
+    [LIMIT_TASKS]  = { "TasksMax",  "pids.max" },
+    [LIMIT_IO]     = { "IOWeight",  "io.weight" }
+};
+
+#define STATE_MAGIC   0x54534e45u /* "ENST" */
+#define STATE_VERSION 1
+
+/* With --state-dir, every worker keeps the running agents of its shard
+ * in a file there: a struct state_header_t, then a struct
+ * state_record_t for each agent followed by its strings. */
+struct state_header_t {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct state_record_t {
+    uint64_t start_time;
+    uint32_t uid;
+    int32_t type;
+    int32_t pid;
+    uint16_t sock_len;
+    uint16_t gpg_len;
+    uint16_t unit_len;
+};
+
+/* How long to wait for a request before deciding we're talking to a
+ * legacy client, which waits for envoyd to speak first. */
+#define LEGACY_GRACE_NS (50 * 1000 * 1000)
+
+struct event_t {
+    int fd;
+    void (*fn)(struct event_t *evt, uint32_t events);
+    void *data;
+    struct event_t *next;
+};
+
+struct client_t {
+    int fd;
+    int version;
+    struct ucred cred;
+    struct event_t *evt;
+    struct event_t *timer;
+    struct client_t *next;
+    enum agent watching;
+    size_t len;
+    char buf[256];
+};
+
+struct spawn_t {
+    struct agent_info_t *node;
     struct agent_data_t d;
-    struct agent_info_t *next;
+    struct client_t *waiters;
+    struct batch_t *batches;
+    struct relay_t *relays;
+    pid_t pid;
+    int park;
+    bool scope_pending;
+    bool exited;
+    bool answered;
+    int stat;
+    struct event_t *output;
+    struct event_t *exit;
+    uint64_t started;
+    struct agent_output_t parser;
+};
+
+/* A client asking about several agents at once. It waits on the spawn
+ * of each agent still starting, linked through next[] for that agent's
+ * type, and is answered once pending drops to zero. */
+struct batch_t {
+    struct client_t *client;
+    unsigned mask;
+    unsigned pending;
+    struct agent_data_t d[AGENT_MAX];
+    struct batch_t *next[AGENT_MAX];
+};
+
+/* In --proxy mode, envoyd listens on a socket of its own for each of a
+ * user's agents and relays connections to whichever agent is running.
+ * Clients are handed this socket instead of the agent's, so the path
+ * they hold on to outlives agent restarts. A proxy that couldn't be set
+ * up has no evt, and is retried after retry. */
+struct proxy_t {
+    uid_t uid;
+    enum agent type;
+    struct event_t *evt;
+    time_t retry;
+    struct proxy_t *next;
+    char path[PATH_MAX];
+};
+
+/* One direction of a relayed connection. Bytes are spliced from the
+ * source into the pipe and from the pipe into the destination, so they
+ * never get copied through envoyd. */
+struct splice_t {
+    int pipe[2];
+    size_t pending;
+    bool eof;
+};
+
+struct relay_t {
+    int client_fd;
+    int agent_fd;
+    struct event_t *client;
+    struct event_t *agent;
+    struct splice_t up;
+    struct splice_t down;
+    struct relay_t *next;
 };
 
+/* A thread with its own epoll loop and its own shard of the registry.
+ * Other threads hand it work by pushing onto its queues, then waking
+ * it through wake_fd. */
+struct worker_t {
+    pthread_t thread;
+    int wake_fd;
+    struct proxy_t *proxies;
+    struct client_t *inbox;
+    struct bus_request_t *replies;
+};
+
+enum bus_op {
+    BUS_START_SCOPE,
+    BUS_KILL_UNIT
+};
+
+/* Work for whichever thread owns the bus. If done is set, it's called
+ * back on the submitting worker, and owns the request from there. */
+struct bus_request_t {
+    enum bus_op op;
+    pid_t pid;
+    uid_t uid;
+    int signal;
+    int pidfd;
+    enum agent type;
+    char unit_path[PATH_MAX];
+    int rc;
+    void (*done)(struct bus_request_t *req);
+    void *data;
+    uint64_t submitted;
+    struct worker_t *owner;
+    struct bus_request_t *next;
+};
+
+/* HDR style latency histogram: exact below 8ns, then 8 buckets per
+ * power of two, so a bucket is never more than 12.5% wide. Shared by
+ * all workers and only ever touched with relaxed atomics. */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+static uint64_t counters[ENVOY_COUNTER_MAX];
+static struct histogram_t timings[ENVOY_PHASE_MAX];
+
+/* Only touched by whichever thread owns the bus: connected on first
+ * use, and dropped after a failed call so the next one reconnects */
 static dbus_bus *bus = NULL;
+static time_t bus_retry = 0;
 static enum agent default_type = AGENT_SSH_AGENT;
-static struct agent_info_t *agents = NULL;
+static uint32_t agents_config;
+static bool prestart[AGENT_MAX];
+static char limits[AGENT_MAX][LIMIT_MAX][32];
+static time_t idle_timeout = 0;
+static const char *state_dir = NULL;
+static struct agent_info_t *restored;
+static size_t restored_count;
 static bool sd_activated = false;
 static bool multiuser_mode;
-static int epoll_fd, server_sock;
+static bool proxy_mode;
+static int server_sock;
+
+static struct worker_t *workers;
+static size_t nworkers = 1;
+static _Thread_local struct worker_t *self;
+static _Thread_local struct registry_t agents = { .size = 0 };
+static _Thread_local int epoll_fd;
+static _Thread_local struct event_t *dead_events = NULL;
+static _Thread_local struct client_t *watchers = NULL;
+
+/* With a single worker there's no bus thread and bus_wake_fd is -1 */
+static int bus_wake_fd = -1;
+static int signal_fd = -1;
+static bool stopping;
+static uint64_t stop_deadline;
+static struct bus_request_t *bus_queue;
+static _Thread_local bool on_bus_thread;
 
 static union agent_environ_t {
     struct {
@@ -59,419 +328,2863 @@ static union agent_environ_t {
     .env = { 0 }
 };
 
-static void kill_agents(int signal)
+/* Agents with an environ whitelist get an environment of their own,
+ * built at startup. The first slot is left for HOME. */
+static char **agent_envs[AGENT_MAX];
+
+static struct agent_info_t registry_tombstone;
+
+/* The queues are lock-free stacks: any thread can push, but only the
+ * owner takes, and it takes everything at once. */
+static void push_client(struct client_t **head, struct client_t *client)
+{
+    struct client_t *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+    do {
+        client->next = old;
+    } while (!__atomic_compare_exchange_n(head, &old, client, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static struct client_t *take_clients(struct client_t **head)
+{
+    struct client_t *client = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+    struct client_t *fifo = NULL;
+
+    while (client) {
+        struct client_t *next = client->next;
+        client->next = fifo;
+        fifo = client;
+        client = next;
+    }
+
+    return fifo;
+}
+
+static void push_request(struct bus_request_t **head, struct bus_request_t *req)
+{
+    struct bus_request_t *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+    do {
+        req->next = old;
+    } while (!__atomic_compare_exchange_n(head, &old, req, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static struct bus_request_t *take_requests(struct bus_request_t **head)
+{
+    struct bus_request_t *req = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+    struct bus_request_t *fifo = NULL;
+
+    while (req) {
+        struct bus_request_t *next = req->next;
+        req->next = fifo;
+        fifo = req;
+        req = next;
+    }
+
+    return fifo;
+}
+
+static void wake(int fd)
+{
+    uint64_t one = 1;
+
+    /* EAGAIN means the counter is saturated, and a wakeup is pending */
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        warn("failed to wake thread");
+}
+
+static time_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void count(enum envoy_counter counter)
+{
+    __atomic_fetch_add(&counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+static size_t histogram_bucket(uint64_t value)
+{
+    if (value < (1 << HISTOGRAM_SUB_BITS))
+        return value;
+
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    size_t sub = (value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS) | sub;
+}
+
+/* The largest value that lands in the bucket */
+static uint64_t histogram_value(size_t bucket)
+{
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+        return bucket;
+
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (((1 << HISTOGRAM_SUB_BITS | sub) + 1) << shift) - 1;
+}
+
+/* Record how long a phase took, given the now_ns() it started at */
+static void record_timing(enum envoy_phase phase, uint64_t start)
+{
+    struct histogram_t *hist = &timings[phase];
+    uint64_t elapsed = now_ns() - start;
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&hist->buckets[histogram_bucket(elapsed)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+    while (elapsed > max && !__atomic_compare_exchange_n(&hist->max, &max, elapsed, true,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static ssize_t read_scope_file(int dirfd, const char *scope, const char *file,
+                               char *buf, size_t size)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", scope, file);
+    int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ssize_t nbytes_r = read(fd, buf, size - 1);
+    close(fd);
+    if (nbytes_r >= 0)
+        buf[nbytes_r] = '\0';
+    return nbytes_r;
+}
+
+/* Add an envoy-monitor-UID-AGENT.scope below dirfd to its agent type's
+ * usage */
+static void add_scope_usage(int dirfd, const char *scope, struct envoy_stats_t *stats)
+{
+    unsigned long long value;
+    char agent[64], buf[256];
+    unsigned uid;
+
+    if (sscanf(scope, "envoy-monitor-%u-%63[^.]", &uid, agent) != 2)
+        return;
+
+    enum agent type = lookup_agent(agent);
+    if (type == AGENT_MAX)
+        return;
+
+    struct envoy_usage_t *usage = &stats->usage[type];
+    ++usage->scopes;
+
+    if (read_scope_file(dirfd, scope, "memory.current", buf, sizeof(buf)) > 0 &&
+        sscanf(buf, "%llu", &value) == 1) {
+        usage->memory += value;
+        if (value > usage->memory_max)
+            usage->memory_max = value;
+    }
+
+    if (read_scope_file(dirfd, scope, "cpu.stat", buf, sizeof(buf)) > 0 &&
+        sscanf(buf, "usage_usec %llu", &value) == 1)
+        usage->cpu += value;
+}
+
+/* Our scopes can end up in whatever slice systemd picks, so search the
+ * tree for them. They don't nest, so nothing inside a scope is looked
+ * at. Takes ownership of fd. */
+static void walk_scopes(int fd, int depth, struct envoy_stats_t *stats)
+{
+    struct dirent *ent;
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        size_t len = strlen(ent->d_name);
+
+        if (ent->d_type != DT_DIR || ent->d_name[0] == '.')
+            continue;
+
+        if (len > 6 && strcmp(&ent->d_name[len - 6], ".scope") == 0) {
+            if (strncmp(ent->d_name, "envoy-monitor-", 14) == 0)
+                add_scope_usage(dirfd(dir), ent->d_name, stats);
+        } else if (depth > 1) {
+            int child = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (child >= 0)
+                walk_scopes(child, depth - 1, stats);
+        }
+    }
+
+    closedir(dir);
+}
+
+/* The snapshot isn't atomic as a whole, so the totals can be a few
+ * samples ahead or behind of the buckets under load */
+static void collect_stats(struct envoy_stats_t *stats)
 {
-    while (agents) {
-        if (agents->d.unit_path[0]) {
-            unit_kill(bus, agents->d.unit_path, signal);
-        } else {
-            kill(agents->d.pid, signal);
+    static const unsigned quantiles[] = { 50, 90, 99 };
+    size_t i, q, bucket;
+
+    *stats = (struct envoy_stats_t){ .counters = { 0 } };
+
+    for (i = 0; i < ENVOY_COUNTER_MAX; ++i)
+        stats->counters[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+
+    for (i = 0; i < ENVOY_PHASE_MAX; ++i) {
+        const struct histogram_t *hist = &timings[i];
+        struct envoy_timing_t *timing = &stats->timings[i];
+        uint64_t buckets[HISTOGRAM_BUCKETS], total = 0, seen = 0;
+        uint64_t *values[] = { &timing->p50, &timing->p90, &timing->p99 };
+
+        for (bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+            total += buckets[bucket] = __atomic_load_n(&hist->buckets[bucket], __ATOMIC_RELAXED);
+
+        timing->count = total;
+        timing->sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+        timing->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+        if (!total)
+            continue;
+
+        for (bucket = 0, q = 0; bucket < HISTOGRAM_BUCKETS && q < 3; ++bucket) {
+            seen += buckets[bucket];
+            for (; q < 3 && seen * 100 >= total * quantiles[q]; ++q) {
+                uint64_t value = histogram_value(bucket);
+                *values[q] = value < timing->max ? value : timing->max;
+            }
         }
+    }
+
+    /* the unified hierarchy of a hybrid setup, or the only one */
+    int fd = open("/sys/fs/cgroup/unified", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        fd = open("/sys/fs/cgroup", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+        walk_scopes(fd, SCOPE_SEARCH_DEPTH, stats);
+}
+
+static size_t registry_hash(uid_t uid, enum agent type)
+{
+    uint64_t key = (uint64_t)uid << 8 | (uint8_t)type;
+
+    /* murmur3's 64-bit finalizer */
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return key;
+}
+
+static struct agent_info_t **registry_find_slot(struct registry_t *reg, uid_t uid,
+                                                enum agent type, bool insert)
+{
+    struct agent_info_t **tombstone = NULL;
+    size_t mask = reg->size - 1;
+    size_t i = registry_hash(uid, type) & mask;
+
+    for (;; i = (i + 1) & mask) {
+        struct agent_info_t **slot = &reg->slots[i];
+
+        if (*slot == NULL)
+            return insert && tombstone ? tombstone : slot;
+        else if (*slot == &registry_tombstone) {
+            if (!tombstone)
+                tombstone = slot;
+        } else if ((*slot)->uid == uid && (*slot)->type == type)
+            return slot;
+    }
+}
+
+static void registry_resize(struct registry_t *reg, size_t size)
+{
+    struct agent_info_t **old = reg->slots;
+    size_t i, old_size = reg->size;
+
+    reg->slots = calloc(size, sizeof(struct agent_info_t *));
+    if (!reg->slots)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    reg->size = size;
+    reg->used = reg->count;
+
+    for (i = 0; i < old_size; ++i) {
+        struct agent_info_t *node = old[i];
+
+        if (node && node != &registry_tombstone)
+            *registry_find_slot(reg, node->uid, node->type, true) = node;
+    }
+
+    free(old);
+}
+
+static struct agent_info_t *registry_lookup(struct registry_t *reg, uid_t uid, enum agent type)
+{
+    if (reg->count == 0)
+        return NULL;
+
+    return *registry_find_slot(reg, uid, type, false);
+}
+
+static struct agent_info_t *registry_insert(struct registry_t *reg, uid_t uid, enum agent type)
+{
+    struct agent_info_t **slot, *node;
+
+    /* keep the load, tombstones included, under 3/4 */
+    if (4 * (reg->used + 1) > 3 * reg->size) {
+        size_t size = reg->size ? reg->size : 64;
+        registry_resize(reg, 4 * (reg->count + 1) > 2 * size ? 2 * size : size);
+    }
+
+    slot = registry_find_slot(reg, uid, type, true);
+    if (*slot && *slot != &registry_tombstone)
+        return *slot;
+
+    node = calloc(1, sizeof(struct agent_info_t));
+    if (!node)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    node->uid = uid;
+    node->type = type;
+    node->d.type = type;
+    node->pidfd = -1;
+
+    if (*slot == NULL)
+        ++reg->used;
+    ++reg->count;
+    *slot = node;
+    return node;
+}
+
+static void registry_remove(struct registry_t *reg, struct agent_info_t *node)
+{
+    struct agent_info_t **slot = registry_find_slot(reg, node->uid, node->type, false);
+
+    if (*slot != node)
+        return;
+
+    *slot = &registry_tombstone;
+    --reg->count;
+}
+
+/* Iterate over every agent in the registry. Start with *iter = 0. */
+static struct agent_info_t *registry_next(struct registry_t *reg, size_t *iter)
+{
+    while (*iter < reg->size) {
+        struct agent_info_t *node = reg->slots[(*iter)++];
+
+        if (node && node != &registry_tombstone)
+            return node;
+    }
+
+    return NULL;
+}
+
+static struct proxy_t *proxy_find(uid_t uid, enum agent type)
+{
+    struct proxy_t *proxy;
+
+    for (proxy = self->proxies; proxy; proxy = proxy->next)
+        if (proxy->uid == uid && proxy->type == type)
+            return proxy;
+
+    return NULL;
+}
+
+/* The socket clients should be handed in place of the agent's own, or
+ * NULL if they should get the agent's */
+static const char *proxy_sock(const struct agent_data_t *data, uid_t uid)
+{
+    if (!proxy_mode || !data->sock[0] || data->type < 0 || data->type >= agent_count ||
+        (data->status != ENVOY_RUNNING && data->status != ENVOY_STARTED))
+        return NULL;
+
+    struct agent_info_t *node = registry_lookup(&agents, uid, data->type);
+    struct proxy_t *proxy = node && node->proxy ? node->proxy : proxy_find(uid, data->type);
+
+    if (!proxy || !proxy->evt)
+        return NULL;
+    if (node)
+        node->proxy = proxy;
+    return proxy->path;
+}
+
+static const struct agent_data_t *proxied(const struct agent_data_t *data, uid_t uid,
+                                          struct agent_data_t *copy)
+{
+    const char *sock = proxy_sock(data, uid);
+
+    if (!sock)
+        return data;
+
+    *copy = *data;
+    strcpy(copy->sock, sock);
+    return copy;
+}
+
+/* Copy the agent's state into its user's ENVOY_SHM_PATH file. The
+ * file lives in a directory the user owns, so refuse to follow links
+ * or write into anything we didn't create ourselves. */
+static void publish_agent(const struct agent_info_t *node)
+{
+    struct envoy_shm_t *shm;
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), ENVOY_SHM_PATH, node->uid);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            warn("failed to open %s", path);
+        return;
+    }
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid() || st.st_nlink != 1) {
+        warnx("refusing to publish agents to %s", path);
+        close(fd);
+        return;
+    }
+
+    if ((size_t)st.st_size < sizeof(*shm) && ftruncate(fd, sizeof(*shm)) < 0) {
+        warn("failed to resize %s", path);
+        close(fd);
+        return;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        warn("failed to map %s", path);
+        return;
+    }
+
+    /* left behind by an envoyd with a different layout */
+    if (shm->magic != ENVOY_SHM_MAGIC || shm->version != ENVOY_SHM_VERSION)
+        memset(shm, 0, sizeof(*shm));
+
+    /* an odd count means a write was interrupted, keep it odd */
+    uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&shm->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct envoy_shm_agent_t *record = &shm->agents[node->type];
+    *record = (struct envoy_shm_agent_t){
+        .status = node->d.status,
+        .pid    = node->d.pid
+    };
+    const char *sock = proxy_sock(&node->d, node->uid);
+    strncpy(record->sock, sock ? sock : node->d.sock, sizeof(record->sock));
+    memcpy(record->gpg, node->d.gpg, sizeof(record->gpg));
+    memcpy(record->home, node->d.home, sizeof(record->home));
+
+    shm->magic = ENVOY_SHM_MAGIC;
+    shm->version = ENVOY_SHM_VERSION;
+    shm->daemon = getpid();
+    shm->default_agent = default_type;
+    shm->config = agents_config;
+    strncpy(shm->socket, get_socket_path(), sizeof(shm->socket));
+
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELEASE);
+    munmap(shm, sizeof(*shm));
+}
+
+static int sys_pidfd_open(pid_t pid)
+{
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int sys_pidfd_send_signal(int pidfd, int signal)
+{
+    return syscall(SYS_pidfd_send_signal, pidfd, signal, NULL, 0);
+}
+
+/* For forked children, which inherit every other spawn's fds until
+ * they exec. A parked agent holding another's park pipe open would
+ * keep it parked for as long as it is. */
+static void close_fds_from(int first)
+{
+    long fd, max;
+
+    if (syscall(SYS_close_range, first, ~0U, 0) == 0)
+        return;
+
+    max = sysconf(_SC_OPEN_MAX);
+    for (fd = first; fd < max; ++fd)
+        close(fd);
+}
+
+/* Through the pidfd when there is one, so a recycled pid can't be hit */
+static int signal_pid(int pidfd, pid_t pid, int signal)
+{
+    if (pidfd >= 0)
+        return sys_pidfd_send_signal(pidfd, signal);
+    return kill(pid, signal);
+}
+
+static dbus_bus *get_bus(void)
+{
+    if (bus || now() < bus_retry)
+        return bus;
+
+    if (dbus_open(DBUS_AUTO, &bus) < 0) {
+        warnx("failed to connect to dbus, agents won't get scopes for now");
+        if (bus)
+            dbus_close(bus);
+        bus = NULL;
+        bus_retry = now() + BUS_RETRY;
+    }
+
+    return bus;
+}
+
+/* After a failed call, there's no telling if the connection is still
+ * good, so start over with a new one */
+static void drop_bus(void)
+{
+    if (bus)
+        dbus_close(bus);
+    bus = NULL;
+}
+
+static struct event_t *event_add(int fd, uint32_t events,
+                                 void (*fn)(struct event_t *, uint32_t),
+                                 void *data)
+{
+    struct event_t *evt = malloc(sizeof(struct event_t));
+    if (!evt)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    *evt = (struct event_t){ .fd = fd, .fn = fn, .data = data };
+
+    struct epoll_event event = {
+        .data.ptr = evt,
+        .events   = events
+    };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        err(EXIT_FAILURE, "failed to add fd to epoll");
+
+    return evt;
+}
+
+/* Removes the fd from epoll, but doesn't close it. The event itself
+ * sticks around until the end of the current epoll batch, as a later
+ * entry in it may still reference it. */
+static void event_del(struct event_t *evt)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, evt->fd, NULL);
+
+    evt->fd = -1;
+    evt->next = dead_events;
+    dead_events = evt;
+}
+
+static void client_free(struct client_t *client)
+{
+    if (client->evt)
+        event_del(client->evt);
+    if (client->timer) {
+        close(client->timer->fd);
+        event_del(client->timer);
+    }
+
+    close(client->fd);
+    free(client);
+}
 
-        agents = agents->next;
+/* Find the cgroup v2 path of a process, either on a unified or a
+ * hybrid hierarchy, and open one of its control files. */
+static int open_cgroup_file(pid_t pid, const char *file, int flags)
+{
+    static const char *const mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+    char path[PATH_MAX], *line = NULL;
+    size_t i, len = 0;
+    int fd = -1;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+    fp = fopen(path, "re");
+    if (!fp)
+        return -1;
+
+    while (getline(&line, &len, fp) > 0) {
+        if (strncmp(line, "0::", 3) != 0)
+            continue;
+
+        line[strcspn(line, "\n")] = '\0';
+        for (i = 0; fd < 0 && i < sizeof(mounts) / sizeof(mounts[0]); ++i) {
+            snprintf(path, sizeof(path), "%s%s/%s", mounts[i], &line[3], file);
+            fd = open(path, flags | O_CLOEXEC);
+        }
+        break;
     }
+
+    free(line);
+    fclose(fp);
+    return fd;
+}
+
+/* Where an open cgroup control file lives, if it belongs to one of our
+ * scopes. An agent that isn't where systemd was asked to put it must
+ * not take the rest of its cgroup down with it. */
+static char *scope_file_path(int fd, char *path)
+{
+    char link[64];
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, path, PATH_MAX - 1);
+    if (len < 0)
+        return NULL;
+    path[len] = '\0';
+
+    char *slash = strrchr(path, '/');
+    if (!slash || !strstr(path, "/envoy-monitor-"))
+        return NULL;
+    return slash;
+}
+
+/* The process's start time, in clock ticks since boot, tells a pid
+ * apart from whatever reused it. 0 if it's gone or isn't uid's. */
+static uint64_t proc_start_time(pid_t pid, uid_t uid)
+{
+    char path[PATH_MAX], buf[BUFSIZ], *p, *saveptr;
+    unsigned long long start_time = 0;
+    struct stat st;
+    ssize_t nbytes_r;
+    int i;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) < 0 || st.st_uid != uid) {
+        close(fd);
+        return 0;
+    }
+
+    nbytes_r = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nbytes_r <= 0)
+        return 0;
+    buf[nbytes_r] = '\0';
+
+    /* the command name can contain anything, so skip past it, then
+     * starttime is the 20th field after it */
+    p = strrchr(buf, ')');
+    if (!p)
+        return 0;
+
+    p = strtok_r(p + 1, " ", &saveptr);
+    for (i = 1; p && i < 20; ++i)
+        p = strtok_r(NULL, " ", &saveptr);
+
+    if (p)
+        start_time = strtoull(p, NULL, 10);
+    return start_time;
+}
+
+static void write_record(FILE *fp, const struct agent_info_t *node)
+{
+    struct state_record_t record = {
+        .start_time = node->start_time,
+        .uid        = node->uid,
+        .type       = node->type,
+        .pid        = node->d.pid,
+        .sock_len   = strlen(node->d.sock),
+        .gpg_len    = strlen(node->d.gpg),
+        .unit_len   = strlen(node->d.unit_path)
+    };
+
+    fwrite(&record, sizeof(record), 1, fp);
+    fwrite(node->d.sock, 1, record.sock_len, fp);
+    fwrite(node->d.gpg, 1, record.gpg_len, fp);
+    fwrite(node->d.unit_path, 1, record.unit_len, fp);
+}
+
+/* Checkpoint this worker's running agents, so the next envoyd can
+ * pick them up */
+static void save_state(void)
+{
+    struct state_header_t hdr = { .magic = STATE_MAGIC, .version = STATE_VERSION };
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct agent_info_t *node;
+    size_t iter = 0;
+
+    if (!state_dir)
+        return;
+
+    size_t index = self - workers;
+    snprintf(path, sizeof(path), "%s/worker-%zu", state_dir, index);
+    snprintf(tmp, sizeof(tmp), "%s/.worker-%zu.tmp", state_dir, index);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!fp) {
+        warn("failed to save state to %s", tmp);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    while ((node = registry_next(&agents, &iter))) {
+        if (node->d.status == ENVOY_RUNNING && node->d.pid > 0)
+            write_record(fp, node);
+    }
+
+    bool failed = ferror(fp);
+    if (fclose(fp) != 0)
+        failed = true;
+
+    if (failed || rename(tmp, path) < 0) {
+        warn("failed to save state to %s", path);
+        unlink(tmp);
+    }
+}
+
+static void unwatch(struct client_t *client)
+{
+    struct client_t **link = &watchers;
+
+    while (*link != client)
+        link = &(*link)->next;
+    *link = client->next;
+    client_free(client);
+}
+
+/* Push the agent's new state to everyone watching it. A watcher that
+ * can't keep up, or has gone away, is dropped. */
+static void notify_watchers(const struct agent_info_t *node)
+{
+    struct client_t *client = watchers, *next;
+    struct agent_data_t copy;
+    char buf[ENVOY_MAX_MESSAGE];
+
+    const struct agent_data_t *data = proxied(&node->d, node->uid, &copy);
+
+    for (; client; client = next) {
+        next = client->next;
+        if (client->cred.uid != node->uid || client->watching != node->type)
+            continue;
+
+        ssize_t len = envoy_encode_agent(buf, sizeof(buf), data, client->version);
+        if (len < 0) {
+            errno = (int)-len;
+            warn("failed to encode agent data");
+            unwatch(client);
+        } else if (send(client->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+            unwatch(client);
+        }
+    }
+}
+
+static void agent_stopped(struct agent_info_t *node)
+{
+    printf("%s for uid=%u has stopped.\n", Agent[node->type]->name, node->uid);
+    fflush(stdout);
+
+    if (node->watch) {
+        if (node->watch->fd != node->pidfd)
+            close(node->watch->fd);
+        event_del(node->watch);
+        node->watch = NULL;
+    }
+    if (node->pidfd >= 0) {
+        close(node->pidfd);
+        node->pidfd = -1;
+    }
+
+    node->d.pid = 0;
+    node->d.status = ENVOY_STOPPED;
+    publish_agent(node);
+    notify_watchers(node);
+    save_state();
+}
+
+/* The socket's path is the user's to choose, so whatever answers on it
+ * has to be running as the user before anything is passed on to it. */
+static int connect_agent(const char *sock, uid_t uid)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int fd;
+
+    if (strlen(sock) >= sizeof(sa.sun_path))
+        return -1;
+    strcpy(sa.sun_path, sock);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        warn("failed to connect to %s", sock);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != uid) {
+        warnx("refusing %s, it isn't served by uid=%u", sock, uid);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void on_agent_cgroup(struct event_t *evt, uint32_t events)
+{
+    char buf[256];
+    (void)events;
+
+    ssize_t nbytes_r = pread(evt->fd, buf, sizeof(buf) - 1, 0);
+    if (nbytes_r > 0) {
+        buf[nbytes_r] = '\0';
+        if (!strstr(buf, "populated 0"))
+            return;
+    }
+
+    agent_stopped(evt->data);
+}
+
+static void on_agent_pidfd(struct event_t *evt, uint32_t events)
+{
+    (void)events;
+    agent_stopped(evt->data);
+}
+
+/* An agent with no pid to watch, like gpg-agent 2.1 outside of a
+ * scope, is tracked through a connection to its socket instead. The
+ * agent never speaks first, so it only turns readable once it's gone. */
+static bool watch_socket(struct agent_info_t *node)
+{
+    int fd = connect_agent(node->d.sock, node->uid);
+    if (fd < 0)
+        return false;
+
+    node->watch = event_add(fd, EPOLLIN | EPOLLRDHUP, on_agent_pidfd, node);
+    return true;
+}
+
+/* Track the agent's lifetime without having to ask anyone. When it
+ * lives in its own scope, the kernel notifies us through the scope's
+ * cgroup.events once it empties out, which is exactly when systemd
+ * considers it dead. Otherwise, fall back to the pidfd. Either way the
+ * pidfd is held on to, it's what the agent gets signalled through. */
+static void watch_agent(struct agent_info_t *node)
+{
+    int fd;
+
+    node->pidfd = sys_pidfd_open(node->d.pid);
+    if (node->pidfd < 0 && errno == ESRCH) {
+        agent_stopped(node);
+        return;
+    }
+
+    if (node->d.unit_path[0]) {
+        fd = open_cgroup_file(node->d.pid, "cgroup.events", O_RDONLY);
+        if (fd >= 0) {
+            node->watch = event_add(fd, EPOLLPRI, on_agent_cgroup, node);
+            return;
+        }
+    }
+
+    if (node->pidfd >= 0) {
+        node->watch = event_add(node->pidfd, EPOLLIN, on_agent_pidfd, node);
+    } else {
+        warn("unable to track the lifetime of %s pid=%d",
+             Agent[node->type]->name, node->d.pid);
+    }
+}
+
+static void init_agent_environ(void)
+{
+    extern char **environ;
+    char *path = NULL, *gnupghome = NULL;
+    enum agent type;
+    int i;
+
+    for (i = 0; environ[i]; ++i) {
+        if (strncmp(environ[i], "PATH=", 5) == 0)
+            path = environ[i];
+        else if (strncmp(environ[i], "GNUPGHOME=", 10) == 0)
+            gnupghome = environ[i];
+    }
+
+    agent_env.arg.path = path ? path : "PATH=/usr/local/bin:/usr/bin/:/bin";
+
+    if (gnupghome && !multiuser_mode)
+        agent_env.arg.gnupghome = gnupghome;
+    else if (gnupghome)
+        fprintf(stderr, "warning: running as root and GNUPGHOME is set; ignoring.\n");
+
+    for (type = 0; type < agent_count; ++type) {
+        char *const *names = Agent[type]->environ;
+        size_t n = 0, count = 0;
+
+        if (!names)
+            continue;
+
+        while (names[n])
+            ++n;
+        for (i = 0; environ[i]; ++i)
+            ++count;
+
+        char **env = calloc(n + count + 4, sizeof(char *));
+        if (!env)
+            err(EXIT_FAILURE, "failed to allocate memory");
+
+        count = 1;
+        for (i = 0; i < 3; ++i)
+            if (agent_env.env[i])
+                env[count++] = agent_env.env[i];
+
+        for (i = 0; environ[i]; ++i) {
+            const char *eq = strchr(environ[i], '=');
+            size_t j;
+
+            if (!eq)
+                continue;
+            for (j = 0; j < n; ++j) {
+                if (strlen(names[j]) == (size_t)(eq - environ[i]) &&
+                    memcmp(names[j], environ[i], eq - environ[i]) == 0) {
+                    env[count++] = environ[i];
+                    break;
+                }
+            }
+        }
+
+        agent_envs[type] = env;
+    }
+}
+
+/* systemd's object path for a unit: every character but letters, and
+ * digits past the first, is escaped as _xx */
+static void unit_object_path(char *buf, size_t size, const char *unit)
+{
+    size_t len = snprintf(buf, size, "/org/freedesktop/systemd1/unit/");
+    const char *c;
+
+    for (c = unit; *c && len + 4 <= size; ++c) {
+        bool alpha = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z');
+        bool digit = *c >= '0' && *c <= '9';
+
+        if (alpha || (digit && c != unit))
+            buf[len++] = *c;
+        else
+            len += snprintf(&buf[len], size - len, "_%02x", (unsigned char)*c);
+    }
+
+    buf[len] = '\0';
+}
+
+/* Write the --limit settings into the agent's new scope while it's
+ * still parked, so they hold from the moment the agent runs */
+static void apply_limits(pid_t pid, enum agent type)
+{
+    char path[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < LIMIT_MAX; ++i) {
+        const char *value = limits[type][i];
+
+        if (!value[0])
+            continue;
+
+        int fd = open_cgroup_file(pid, Limit[i].file, O_WRONLY);
+        if (fd < 0) {
+            warn("failed to set %s for %s", Limit[i].property, Agent[type]->name);
+            continue;
+        }
+
+        if (!scope_file_path(fd, path))
+            warnx("%s isn't in its scope, not setting %s", Agent[type]->name,
+                  Limit[i].property);
+        else if (write(fd, value, strlen(value)) < 0)
+            warn("failed to set %s for %s", Limit[i].property, Agent[type]->name);
+        close(fd);
+    }
+}
+
+/* Put pid into a transient scope of its own and work out where the
+ * scope ends up. The child is parked while this happens, so it's in
+ * the scope before it execs the agent. */
+static int start_scope(pid_t pid, uid_t uid, enum agent type, char *unit_path)
+{
+    const struct agent_t *agent = Agent[type];
+    dbus_message *m;
+    char *scope, *slice = NULL;
+
+    if (!get_bus())
+        return -1;
+
+    if (multiuser_mode && uid != 0)
+        safe_asprintf(&slice, "user-%d.slice", uid);
+    safe_asprintf(&scope, "envoy-monitor-%d-%s.scope", uid, agent->name);
+
+    scope_init(&m, scope, slice, "Envoy agent monitor", pid);
+    int rc = scope_commit(bus, m, NULL);
+    if (rc < 0) {
+        warnx("failed to start transient scope for %s: %s", agent->name, bus->error);
+        drop_bus();
+    } else {
+        unit_object_path(unit_path, PATH_MAX, scope);
+        apply_limits(pid, type);
+    }
+
+    free(scope);
+    free(slice);
+    return rc;
+}
+
+static void run_bus_request(struct bus_request_t *req)
+{
+    switch (req->op) {
+    case BUS_START_SCOPE:
+        req->rc = start_scope(req->pid, req->uid, req->type, req->unit_path);
+        break;
+    case BUS_KILL_UNIT:
+        req->rc = get_bus() ? unit_kill(bus, req->unit_path, req->signal) : -1;
+        if (req->rc < 0) {
+            drop_bus();
+            req->rc = signal_pid(req->pidfd, req->pid, req->signal);
+        }
+        if (req->pidfd >= 0)
+            close(req->pidfd);
+        break;
+    }
+}
+
+static void finish_bus_request(struct bus_request_t *req)
+{
+    if (!req->done) {
+        free(req);
+    } else if (on_bus_thread) {
+        push_request(&req->owner->replies, req);
+        wake(req->owner->wake_fd);
+    } else {
+        req->done(req);
+    }
+}
+
+/* Hand the request to the bus thread, or just make the call if
+ * there's no bus thread to hand it to */
+static void submit_bus_request(struct bus_request_t *req)
+{
+    req->owner = self;
+    req->submitted = now_ns();
+
+    if (bus_wake_fd < 0 || on_bus_thread) {
+        run_bus_request(req);
+        finish_bus_request(req);
+        return;
+    }
+
+    push_request(&bus_queue, req);
+    wake(bus_wake_fd);
+}
+
+static struct bus_request_t *new_bus_request(enum bus_op op)
+{
+    struct bus_request_t *req = calloc(1, sizeof(struct bus_request_t));
+    if (!req)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    req->op = op;
+    req->pidfd = -1;
+    return req;
+}
+
+/* Open one of the control files next to fd, an open cgroup.events. The
+ * agent's main process may be gone, so its cgroup can't be looked up
+ * through /proc anymore. */
+static int open_sibling_file(int fd, const char *file, int flags)
+{
+    char path[PATH_MAX];
+    char *slash = scope_file_path(fd, path);
+
+    if (!slash || (size_t)(slash - path) + strlen(file) + 2 > sizeof(path))
+        return -1;
+
+    strcpy(slash + 1, file);
+    return open(path, flags | O_CLOEXEC);
+}
+
+/* Send signal to every process in the agent's scope, like KillUnit
+ * would, but without waiting on systemd to do it */
+static void signal_scope(const struct agent_info_t *node, int signal)
+{
+    char path[PATH_MAX];
+    bool sent = false;
+    pid_t pid;
+
+    int fd = open_cgroup_file(node->d.pid, "cgroup.procs", O_RDONLY);
+    FILE *fp = fd >= 0 && scope_file_path(fd, path) ? fdopen(fd, "r") : NULL;
+
+    if (fp) {
+        while (fscanf(fp, "%d", &pid) == 1)
+            sent |= kill(pid, signal) == 0;
+        fclose(fp);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    if (!sent)
+        signal_pid(node->pidfd, node->d.pid, signal);
+}
+
+/* Whether an agent being waited on at exit is done: its pidfd is
+ * readable, or its scope has emptied out */
+static bool agent_exited(const struct agent_info_t *node)
+{
+    struct pollfd pfd = { .fd = node->pidfd, .events = POLLIN };
+    char buf[256];
+
+    if (node->watch->fd == node->pidfd)
+        return poll(&pfd, 1, 0) > 0;
+
+    ssize_t nbytes_r = pread(node->watch->fd, buf, sizeof(buf) - 1, 0);
+    if (nbytes_r <= 0)
+        return true;
+
+    buf[nbytes_r] = '\0';
+    return strstr(buf, "populated 0") != NULL;
+}
+
+/* Run by every worker on its own agents as the daemon exits. Every
+ * agent is signalled right away, without a round trip to systemd per
+ * agent, then they wait out the deadline all workers share. Any scope
+ * still populated after that is killed whole through cgroup.kill. */
+static void stop_agents(uint64_t deadline)
+{
+    struct agent_info_t **nodes = NULL, *node;
+    struct pollfd *fds = NULL;
+    size_t i, iter, n = 0, size = 0, left;
+
+    for (iter = 0; (node = registry_next(&agents, &iter));) {
+        if (node->d.pid == 0)
+            continue;
+
+        if (node->d.unit_path[0])
+            signal_scope(node, SIGTERM);
+        else
+            signal_pid(node->pidfd, node->d.pid, SIGTERM);
+
+        /* nothing to wait on for an agent we can't track */
+        if (!node->watch)
+            continue;
+
+        if (n == size) {
+            size = size ? 2 * size : 64;
+            nodes = realloc(nodes, size * sizeof(*nodes));
+            fds = realloc(fds, size * sizeof(*fds));
+            if (!nodes || !fds)
+                err(EXIT_FAILURE, "failed to allocate memory");
+        }
+
+        /* kernfs always has cgroup.events readable, it signals changes
+         * through POLLPRI alone */
+        nodes[n] = node;
+        fds[n++] = (struct pollfd){
+            .fd = node->watch->fd,
+            .events = node->watch->fd == node->pidfd ? POLLIN : POLLPRI
+        };
+    }
+
+    while (true) {
+        for (i = 0, left = 0; i < n; ++i) {
+            if (fds[i].fd >= 0 && agent_exited(nodes[i]))
+                fds[i].fd = -1;
+            if (fds[i].fd >= 0)
+                ++left;
+        }
+
+        uint64_t t = now_ns();
+        if (!left || t >= deadline)
+            break;
+
+        /* rounded up, so the last poll doesn't return early */
+        if (poll(fds, n, (deadline - t + 999999) / 1000000) < 0 && errno != EINTR) {
+            warn("failed to wait for agents to stop");
+            break;
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (fds[i].fd < 0)
+            continue;
+
+        node = nodes[i];
+        printf("%s for uid=%u didn't stop in time, killing it.\n", Agent[node->type]->name,
+               node->uid);
+
+        int fd = -1;
+        if (node->watch->fd != node->pidfd)
+            fd = open_sibling_file(node->watch->fd, "cgroup.kill", O_WRONLY);
+        if (fd < 0 || write(fd, "1", 1) < 0)
+            signal_pid(node->pidfd, node->d.pid, SIGKILL);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    free(nodes);
+    free(fds);
+}
+
+/* Each worker tears down its own state once stopping is set, no other
+ * thread touches its registry or proxies */
+static void stop_worker(void)
+{
+    uint64_t deadline = __atomic_load_n(&stop_deadline, __ATOMIC_RELAXED);
+    struct agent_info_t *node;
+    struct proxy_t *proxy;
+    size_t iter;
+
+    for (proxy = self->proxies; proxy; proxy = proxy->next)
+        if (proxy->evt)
+            unlink(proxy->path);
+
+    /* the next envoyd will adopt them */
+    if (state_dir)
+        return;
+
+    stop_agents(deadline);
+
+    for (iter = 0; (node = registry_next(&agents, &iter));) {
+        node->d.pid = 0;
+        node->d.status = ENVOY_STOPPED;
+        publish_agent(node);
+    }
+
+    fflush(stdout);
+}
+
+/* Called on the thread that reads signal_fd. The workers are told to
+ * stop and stop their agents side by side, and are joined before the
+ * daemon exits. With a single worker, this is that worker. */
+static void __attribute__((__noreturn__)) stop_daemon(void)
+{
+    uint64_t wake = 1;
+    size_t i;
+
+    __atomic_store_n(&stop_deadline, now_ns() + (uint64_t)STOP_TIMEOUT_MS * 1000000,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+
+    if (nworkers == 1) {
+        stop_worker();
+    } else {
+        for (i = 0; i < nworkers; ++i)
+            if (write(workers[i].wake_fd, &wake, sizeof(wake)) < 0)
+                warn("failed to wake worker");
+        for (i = 0; i < nworkers; ++i)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    if (!sd_activated) {
+        close(server_sock);
+        unlink_envoy_socket();
+    }
+
+    fflush(stdout);
+    exit(EXIT_SUCCESS);
+}
+
+/* SIGTERM and SIGINT are blocked everywhere and only ever read from
+ * signal_fd, by the thread that owns the bus */
+static void read_signal(void)
+{
+    struct signalfd_siginfo si;
+
+    ssize_t nbytes_r = read(signal_fd, &si, sizeof(si));
+    if (nbytes_r < 0 && errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "failed to read signal");
+    else if (nbytes_r == sizeof(si))
+        stop_daemon();
+}
+
+static void on_signal(struct event_t *evt, uint32_t events)
+{
+    (void)evt;
+    (void)events;
+    read_signal();
+}
+
+static void __attribute__((__noreturn__)) bus_loop(void)
+{
+    struct pollfd fds[] = {
+        { .fd = bus_wake_fd, .events = POLLIN },
+        { .fd = signal_fd,   .events = POLLIN }
+    };
+
+    on_bus_thread = true;
+
+    while (true) {
+        uint64_t count;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            err(EXIT_FAILURE, "failed to wait for bus requests");
+        }
+
+        if (fds[1].revents)
+            read_signal();
+        if (!fds[0].revents)
+            continue;
+
+        if (read(bus_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN && errno != EINTR)
+            err(EXIT_FAILURE, "failed to wait for bus requests");
+
+        struct bus_request_t *req = take_requests(&bus_queue);
+        while (req) {
+            struct bus_request_t *next = req->next;
+
+            run_bus_request(req);
+            finish_bus_request(req);
+            req = next;
+        }
+    }
+}
+
+/* Runs in the forked child of a possibly threaded daemon, so anything
+ * that could take a lock (like a passwd lookup) was done beforehand */
+static void __attribute__((__noreturn__)) exec_agent(enum agent type, uid_t uid, gid_t gid, char *home)
+{
+    const struct agent_t *agent = Agent[type];
+    sigset_t mask;
+
+    /* envoyd reads its signals from a signalfd, the agent shouldn't */
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    if (setresgid(gid, gid, gid) < 0 || setresuid(uid, uid, uid) < 0)
+        err(EXIT_FAILURE, "unable to drop to uid=%u gid=%u\n", uid, gid);
+
+    /* setup the most minimal environment */
+    char *const *env = agent_env.env;
+    char **own = agent_envs[type];
+
+    agent_env.arg.home = home;
+    if (own) {
+        own[0] = home;
+        env = own;
+    }
+
+    execve(agent->argv[0], agent->argv, env);
+    err(EXIT_FAILURE, "failed to start %s", agent->name);
+}
+
+static void send_agent(struct client_t *client, const struct agent_data_t *agent, bool close_sock)
+{
+    char buf[ENVOY_MAX_MESSAGE];
+    struct agent_data_t copy;
+    ssize_t len = ENVOY_LEGACY_SIZE;
+
+    uint64_t start = now_ns();
+    agent = proxied(agent, client->cred.uid, &copy);
+    const void *msg = agent;
+
+    if (client->version != ENVOY_PROTOCOL_LEGACY) {
+        len = envoy_encode_agent(buf, sizeof(buf), agent, client->version);
+        msg = buf;
+    }
+
+    if (len < 0) {
+        errno = (int)-len;
+        warn("failed to encode agent data");
+    } else if (send(client->fd, msg, len, MSG_NOSIGNAL) < 0) {
+        warn("failed to write agent data");
+    }
+    record_timing(ENVOY_PHASE_REPLY, start);
+
+    if (close_sock)
+        client_free(client);
+}
+
+static void send_message(struct client_t *client, enum status status, bool close_sock)
+{
+    struct agent_data_t d = { .status = status };
+    send_agent(client, &d, close_sock);
+}
+
+static void batch_resolved(struct batch_t *batch)
+{
+    char buf[ENVOY_MAX_BATCH];
+    enum agent type;
+
+    if (--batch->pending)
+        return;
+
+    uint64_t start = now_ns();
+    for (type = 0; type < agent_count; ++type) {
+        const char *sock = proxy_sock(&batch->d[type], batch->client->cred.uid);
+        if (sock && batch->mask & ENVOY_AGENT_BIT(type))
+            strcpy(batch->d[type].sock, sock);
+    }
+
+    ssize_t len = envoy_encode_batch(buf, sizeof(buf), batch->d, batch->mask,
+                                     batch->client->version);
+
+    if (len < 0) {
+        errno = (int)-len;
+        warn("failed to encode agent data");
+    } else if (send(batch->client->fd, buf, len, MSG_NOSIGNAL) < 0) {
+        warn("failed to write agent data");
+    }
+    record_timing(ENVOY_PHASE_REPLY, start);
+
+    client_free(batch->client);
+    free(batch);
+}
+
+static void relay_free(struct relay_t *relay)
+{
+    if (relay->client)
+        event_del(relay->client);
+    if (relay->agent)
+        event_del(relay->agent);
+
+    close(relay->client_fd);
+    if (relay->agent_fd >= 0)
+        close(relay->agent_fd);
+    if (relay->up.pipe[0] >= 0) {
+        close(relay->up.pipe[0]);
+        close(relay->up.pipe[1]);
+    }
+    if (relay->down.pipe[0] >= 0) {
+        close(relay->down.pipe[0]);
+        close(relay->down.pipe[1]);
+    }
+
+    free(relay);
+}
+
+/* Move everything that can be moved without blocking. The pipe is only
+ * refilled once it's been drained, so it never fills up. */
+static int relay_pump(struct splice_t *dir, int from, int to)
+{
+    bool moved = true;
+    ssize_t nbytes;
+
+    while (moved) {
+        moved = false;
+
+        if (!dir->pending && !dir->eof) {
+            nbytes = splice(from, NULL, dir->pipe[1], NULL, RELAY_CHUNK,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (nbytes > 0) {
+                dir->pending = nbytes;
+                moved = true;
+            } else if (nbytes == 0) {
+                dir->eof = true;
+                shutdown(to, SHUT_WR);
+            } else if (errno == EINTR) {
+                moved = true;
+            } else if (errno != EAGAIN) {
+                return -errno;
+            }
+        }
+
+        if (dir->pending) {
+            nbytes = splice(dir->pipe[0], NULL, to, NULL, dir->pending,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (nbytes > 0) {
+                dir->pending -= nbytes;
+                moved = true;
+            } else if (nbytes < 0 && errno == EINTR) {
+                moved = true;
+            } else if (nbytes < 0 && errno != EAGAIN) {
+                return -errno;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Edge triggered, so every wakeup moves all it can both ways */
+static void on_relay(struct event_t *evt, uint32_t events)
+{
+    struct relay_t *relay = evt->data;
+    (void)events;
+
+    if (relay_pump(&relay->up, relay->client_fd, relay->agent_fd) < 0 ||
+        relay_pump(&relay->down, relay->agent_fd, relay->client_fd) < 0 ||
+        (relay->up.eof && relay->down.eof))
+        relay_free(relay);
+}
+
+static void relay_start(struct relay_t *relay, const char *sock, uid_t uid)
+{
+    uint32_t events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+
+    relay->agent_fd = connect_agent(sock, uid);
+    if (relay->agent_fd < 0) {
+        relay_free(relay);
+        return;
+    }
+
+    if (pipe2(relay->up.pipe, O_NONBLOCK | O_CLOEXEC) < 0 ||
+        pipe2(relay->down.pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        warn("failed to create pipe");
+        relay_free(relay);
+        return;
+    }
+
+    /* anything already waiting is reported as soon as they're added */
+    relay->client = event_add(relay->client_fd, events, on_relay, relay);
+    relay->agent = event_add(relay->agent_fd, events, on_relay, relay);
+}
+
+/* Feed the parser everything the agent has written so far */
+static void spawn_read_output(struct spawn_t *spawn)
+{
+    char buf[BUFSIZ];
+
+    while (spawn->output) {
+        ssize_t nbytes_r = read(spawn->output->fd, buf, sizeof(buf));
+        if (nbytes_r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return;
+            warn("failed to read %s output", Agent[spawn->d.type]->name);
+        }
+
+        if (nbytes_r <= 0) {
+            agent_output_finish(&spawn->parser, &spawn->d);
+            close(spawn->output->fd);
+            event_del(spawn->output);
+            spawn->output = NULL;
+            return;
+        }
+
+        uint64_t start = now_ns();
+        agent_output_feed(&spawn->parser, buf, nbytes_r, &spawn->d);
+        record_timing(ENVOY_PHASE_PARSE, start);
+    }
+}
+
+/* Everything clients need from the agent has been printed, so there's
+ * no reason to wait on its launcher to exit before answering */
+static bool spawn_ready(const struct spawn_t *spawn)
+{
+    if (spawn->answered || spawn->scope_pending)
+        return false;
+    return agent_output_ready(Agent[spawn->d.type], &spawn->d);
+}
+
+/* An agent that doesn't print its pid, like gpg-agent since 2.1, is
+ * whatever runs in its scope besides the launcher. Only asked while
+ * the launcher is unreaped, so its pid can't have been reused. */
+static pid_t scope_agent_pid(const struct spawn_t *spawn)
+{
+    char path[PATH_MAX];
+    pid_t pid, found = 0;
+
+    if (!spawn->d.unit_path[0])
+        return 0;
+
+    int fd = open_cgroup_file(spawn->pid, "cgroup.procs", O_RDONLY);
+    FILE *fp = fd >= 0 && scope_file_path(fd, path) ? fdopen(fd, "r") : NULL;
+
+    if (fp) {
+        while (!found && fscanf(fp, "%d", &pid) == 1)
+            if (pid != spawn->pid)
+                found = pid;
+        fclose(fp);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    return found;
+}
+
+/* Hand the agent over to its node and answer everyone waiting on it.
+ * The spawn itself sticks around until its launcher has been reaped. */
+static void spawn_answer(struct spawn_t *spawn)
+{
+    struct agent_data_t *data = &spawn->d;
+
+    spawn->answered = true;
+    record_timing(ENVOY_PHASE_SPAWN, spawn->started);
+
+    if (!data->pid && !spawn->exited)
+        data->pid = scope_agent_pid(spawn);
+
+    if (spawn->node->watch)
+        agent_stopped(spawn->node);
+
+    spawn->node->d = *data;
+    spawn->node->spawn = NULL;
+
+    if (spawn->node->d.pid) {
+        spawn->node->d.status = ENVOY_RUNNING;
+        spawn->node->start_time = proc_start_time(spawn->node->d.pid, spawn->node->uid);
+        watch_agent(spawn->node);
+    } else if (data->status != ENVOY_FAILED && spawn->node->d.sock[0] &&
+               watch_socket(spawn->node)) {
+        spawn->node->d.status = ENVOY_RUNNING;
+    }
+
+    /* publish first, so clients we answer can already find it */
+    publish_agent(spawn->node);
+    notify_watchers(spawn->node);
+    save_state();
+
+    /* answer everyone who asked while the agent was starting */
+    while (spawn->waiters) {
+        struct client_t *client = spawn->waiters;
+
+        spawn->waiters = client->next;
+        send_agent(client, data, true);
+    }
+
+    while (spawn->batches) {
+        struct batch_t *batch = spawn->batches;
+
+        spawn->batches = batch->next[data->type];
+        batch->d[data->type] = *data;
+        batch_resolved(batch);
+    }
+
+    while (spawn->relays) {
+        struct relay_t *relay = spawn->relays;
+
+        spawn->relays = relay->next;
+        if (data->status != ENVOY_FAILED && spawn->node->d.sock[0])
+            relay_start(relay, spawn->node->d.sock, spawn->node->uid);
+        else
+            relay_free(relay);
+    }
+}
+
+static void spawn_finish(struct spawn_t *spawn, int stat)
+{
+    const struct agent_t *agent = Agent[spawn->d.type];
+    struct agent_data_t *data = &spawn->d;
+
+    /* killed before its scope came up, wait for the bus to answer */
+    if (spawn->scope_pending) {
+        spawn->exited = true;
+        spawn->stat = stat;
+        return;
+    }
+
+    spawn->exited = true;
+    spawn_read_output(spawn);
+    if (spawn->output) {
+        close(spawn->output->fd);
+        event_del(spawn->output);
+    }
+
+    if (stat) {
+        if (WIFEXITED(stat))
+            fprintf(stderr, "%s exited with status %d.\n",
+                    agent->name, WEXITSTATUS(stat));
+        if (WIFSIGNALED(stat))
+            fprintf(stderr, "%s terminated with signal %d.\n",
+                    agent->name, WTERMSIG(stat));
+    }
+
+    /* the agent is already in use, it's watched like any other now */
+    if (spawn->answered) {
+        free(spawn);
+        return;
+    }
+
+    if (stat) {
+        data->pid = 0;
+        data->status = ENVOY_FAILED;
+        count(ENVOY_COUNTER_FAILURES);
+    }
+
+    spawn_answer(spawn);
+    free(spawn);
+}
+
+static void on_agent_exit(struct event_t *evt, uint32_t events)
+{
+    struct spawn_t *spawn = evt->data;
+    int stat = 0;
+    (void)events;
+
+    pid_t pid = waitpid(spawn->pid, &stat, WNOHANG);
+    if (pid == 0)
+        return;
+    else if (pid < 0)
+        err(EXIT_FAILURE, "failed to get process status");
+
+    close(evt->fd);
+    event_del(evt);
+    spawn_finish(spawn, stat);
+}
+
+static void on_agent_output(struct event_t *evt, uint32_t events)
+{
+    struct spawn_t *spawn = evt->data;
+    (void)events;
+
+    spawn_read_output(spawn);
+    if (spawn_ready(spawn))
+        spawn_answer(spawn);
+
+    /* Without a pidfd to tell us when the agent exits, wait for it
+     * to close its end of the pipe instead, then reap it. */
+    if (!spawn->output && !spawn->exit) {
+        int stat = 0;
+
+        if (waitpid(spawn->pid, &stat, 0) < 0)
+            err(EXIT_FAILURE, "failed to get process status");
+        spawn_finish(spawn, stat);
+    }
+}
+
+/* The parked child is let go once it's in its scope. If systemd
+ * couldn't be reached, it runs without one and is tracked through its
+ * pidfd instead. */
+static void on_scope_started(struct bus_request_t *req)
+{
+    struct spawn_t *spawn = req->data;
+
+    record_timing(ENVOY_PHASE_SCOPE, req->submitted);
+    if (req->rc < 0)
+        warnx("starting %s without a scope", Agent[req->type]->name);
+    else
+        strcpy(spawn->d.unit_path, req->unit_path);
+
+    close(spawn->park);
+    spawn->scope_pending = false;
+    free(req);
+
+    if (spawn->exited)
+        spawn_finish(spawn, spawn->stat);
+    else if (spawn_ready(spawn))
+        spawn_answer(spawn);
+}
+
+/* Look up the user's home directory, at most once every HOME_TTL
+ * seconds. NSS can be slow when it's backed by a directory server. */
+static bool resolve_home(struct agent_info_t *node)
+{
+    struct passwd pwd, *result;
+    char buf[BUFSIZ];
+    time_t t = now();
+    int ngroups = node->ngroups > 0 ? node->ngroups : 16;
+
+    if (node->d.home[0] && t < node->home_expires)
+        return true;
+
+    if (getpwuid_r(node->uid, &pwd, buf, sizeof(buf), &result) != 0 || !result || !pwd.pw_dir) {
+        warnx("failed to lookup passwd entry for uid=%u", node->uid);
+        node->d.home[0] = '\0';
+        return false;
+    }
+
+    /* the groups are for the probe, which runs forked and can't look
+     * them up itself */
+    while (true) {
+        int n = ngroups;
+
+        node->groups = realloc(node->groups, ngroups * sizeof(gid_t));
+        if (!node->groups)
+            err(EXIT_FAILURE, "failed to allocate memory");
+        if (getgrouplist(pwd.pw_name, pwd.pw_gid, node->groups, &n) >= 0) {
+            ngroups = n;
+            break;
+        }
+        ngroups = n > ngroups ? n : 2 * ngroups;
+    }
+
+    snprintf(node->d.home, sizeof(node->d.home), "%s", pwd.pw_dir);
+    node->gid = pwd.pw_gid;
+    node->ngroups = ngroups;
+    node->home_expires = t + HOME_TTL;
+    return true;
+}
+
+/* Returns NULL if the agent couldn't be started */
+static struct spawn_t *run_agent(struct agent_info_t *node, enum agent type,
+                                 const struct ucred *cred)
+{
+    uid_t uid = cred->uid;
+    gid_t gid = cred->gid;
+    const struct agent_t *agent = Agent[type];
+    struct spawn_t *spawn;
+    struct bus_request_t *req;
+    char home[PATH_MAX + 5];
+    int fd[2], park[2], pidfd;
+    uint64_t started = now_ns(), start;
+    char c;
+
+    printf("Starting %s for uid=%u gid=%u.\n", agent->name, uid, gid);
+    fflush(stdout);
+    count(ENVOY_COUNTER_STARTS);
+
+    if (!resolve_home(node))
+        return NULL;
+    snprintf(home, sizeof(home), "HOME=%s", node->d.home);
+
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        warn("failed to create pipe");
+        return NULL;
+    }
+
+    if (pipe2(park, O_CLOEXEC) < 0) {
+        warn("failed to create pipe");
+        close(fd[0]);
+        close(fd[1]);
+        return NULL;
+    }
+
+    start = now_ns();
+    pid_t pid = fork();
+    if (pid > 0)
+        record_timing(ENVOY_PHASE_FORK, start);
+
+    switch (pid) {
+    case -1:
+        warn("failed to fork");
+        close(fd[0]);
+        close(fd[1]);
+        close(park[0]);
+        close(park[1]);
+        return NULL;
+    case 0:
+        /* keep only stdio and our own end of the park pipe, as fd 3 */
+        dup2(fd[1], STDOUT_FILENO);
+        if (park[0] != 3 && dup2(park[0], 3) < 0)
+            _exit(EXIT_FAILURE);
+        close_fds_from(4);
+
+        /* wait until the parent has us in our scope */
+        while (read(3, &c, 1) < 0 && errno == EINTR)
+            ;
+        close(3);
+
+        exec_agent(type, uid, gid, home);
+        break;
+    default:
+        break;
+    }
+
+    close(fd[1]);
+    close(park[0]);
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+    spawn = calloc(1, sizeof(struct spawn_t));
+    if (!spawn)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    spawn->node = node;
+    spawn->pid = pid;
+    spawn->park = park[1];
+    spawn->scope_pending = true;
+    spawn->started = started;
+    spawn->d = (struct agent_data_t){ .type = type, .status = ENVOY_STARTED };
+    strcpy(spawn->d.home, node->d.home);
+    agent_output_init(&spawn->parser, agent);
+    spawn->output = event_add(fd[0], EPOLLIN, on_agent_output, spawn);
+
+    /* the pidfd becomes readable once the agent's launcher exits */
+    pidfd = sys_pidfd_open(pid);
+    if (pidfd >= 0)
+        spawn->exit = event_add(pidfd, EPOLLIN, on_agent_exit, spawn);
+    else if (errno != ENOSYS)
+        warn("failed to open pidfd for %s", agent->name);
+
+    node->spawn = spawn;
+
+    req = new_bus_request(BUS_START_SCOPE);
+    req->pid = pid;
+    req->uid = uid;
+    req->type = type;
+    req->done = on_scope_started;
+    req->data = spawn;
+    submit_bus_request(req);
+    return spawn;
+}
+
+static int get_socket(void)
+{
+    int fd, n;
+
+    n = sd_listen_fds(0);
+    if (n > 1)
+        err(EXIT_FAILURE, "too many file descriptors recieved");
+    else if (n == 1) {
+        fd = SD_LISTEN_FDS_START;
+        sd_activated = true;
+    } else {
+        union {
+            struct sockaddr sa;
+            struct sockaddr_un un;
+        } sa;
+        socklen_t sa_len;
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            err(EXIT_FAILURE, "couldn't create socket");
+
+        sa_len = init_envoy_socket(&sa.un);
+        if (bind(fd, &sa.sa, sa_len) < 0)
+            err(EXIT_FAILURE, "failed to bind");
+
+        if (sa.un.sun_path[0] != '@')
+            chmod(sa.un.sun_path, multiuser_mode ? 0777 : 0700);
+
+        if (listen(fd, SOMAXCONN) < 0)
+            err(EXIT_FAILURE, "failed to listen");
+    }
+
+    return fd;
+}
+
+/* Old clients don't say which agent they want until they're asked to
+ * start one, so prefer the default agent, then whatever else the user
+ * already has running. */
+static struct agent_info_t *lookup_user_agent(uid_t uid)
+{
+    struct agent_info_t *node = registry_lookup(&agents, uid, default_type);
+    enum agent type;
+
+    for (type = 0; (!node || node->d.status != ENVOY_RUNNING) && type < agent_count; ++type)
+        node = registry_lookup(&agents, uid, type);
+
+    return node;
+}
+
+static bool authorized(const struct ucred *cred)
+{
+    uid_t server_uid = geteuid();
+
+    if (server_uid != 0 && server_uid != cred->uid) {
+        fprintf(stderr, "Connection from uid=%u rejected.\n", cred->uid);
+        count(ENVOY_COUNTER_REJECTIONS);
+        return false;
+    }
+
+    return true;
+}
+
+/* Returns the spawn starting the user's agent, forking it unless it's
+ * already starting, or NULL if it couldn't be started */
+static struct spawn_t *spawn_agent(const struct ucred *cred, enum agent type)
+{
+    struct agent_info_t *node = registry_lookup(&agents, cred->uid, type);
+    struct spawn_t *spawn;
+
+    /* Already starting: wait on that spawn rather than forking another
+     * agent into the same scope */
+    if (node && node->spawn)
+        return node->spawn;
+
+    if (!node) {
+        node = registry_insert(&agents, cred->uid, type);
+    } else {
+        printf("%s for uid=%u is has terminated. Restarting...\n",
+               Agent[type]->name, cred->uid);
+        fflush(stdout);
+        count(ENVOY_COUNTER_RESTARTS);
+    }
+
+    node->last_used = now();
+    spawn = run_agent(node, type, cred);
+    if (!spawn)
+        count(ENVOY_COUNTER_FAILURES);
+    return spawn;
+}
+
+static void on_proxy(struct event_t *evt, uint32_t events)
+{
+    struct proxy_t *proxy = evt->data;
+    socklen_t cred_len = sizeof(struct ucred);
+    struct ucred cred;
+    (void)events;
+
+    int cfd = accept4(evt->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (cfd < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            warn("failed to accept connection on %s", proxy->path);
+        return;
+    }
+
+    if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+        warn("couldn't obtain credentials from unix domain socket");
+        close(cfd);
+        return;
+    } else if (cred.uid != proxy->uid) {
+        fprintf(stderr, "Connection to %s from uid=%u rejected.\n", proxy->path, cred.uid);
+        count(ENVOY_COUNTER_REJECTIONS);
+        close(cfd);
+        return;
+    }
+
+    struct relay_t *relay = calloc(1, sizeof(struct relay_t));
+    if (!relay)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    *relay = (struct relay_t){
+        .client_fd = cfd,
+        .agent_fd  = -1,
+        .up.pipe   = { -1, -1 },
+        .down.pipe = { -1, -1 }
+    };
+
+    struct agent_info_t *node = registry_lookup(&agents, proxy->uid, proxy->type);
+    if (node && node->d.status == ENVOY_RUNNING) {
+        node->last_used = now();
+        relay_start(relay, node->d.sock, node->uid);
+        return;
+    }
+
+    /* no agent to relay to, start one and wait for it */
+    struct spawn_t *spawn = spawn_agent(&cred, proxy->type);
+    if (!spawn) {
+        relay_free(relay);
+        return;
+    }
+
+    spawn->node->proxy = proxy;
+    relay->next = spawn->relays;
+    spawn->relays = relay;
+}
+
+/* Make sure the user's proxy for the agent is listening. The socket is
+ * bound in a directory the user owns: it's made private before it's
+ * bound, and only handed over to the user after. */
+static void proxy_listen(uid_t uid, enum agent type)
+{
+    struct agent_info_t *node = registry_lookup(&agents, uid, type);
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    struct proxy_t *proxy;
+
+    if (!proxy_mode || (node && node->proxy && node->proxy->evt))
+        return;
+
+    proxy = proxy_find(uid, type);
+    if (!proxy) {
+        proxy = calloc(1, sizeof(struct proxy_t));
+        if (!proxy)
+            err(EXIT_FAILURE, "failed to allocate memory");
+
+        proxy->uid = uid;
+        proxy->type = type;
+        snprintf(proxy->path, sizeof(proxy->path), PROXY_PATH, uid, Agent[type]->name);
+        proxy->next = self->proxies;
+        self->proxies = proxy;
+    } else if (!proxy->evt && now() < proxy->retry) {
+        return;
+    }
+
+    if (node)
+        node->proxy = proxy;
+    if (proxy->evt)
+        return;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || strlen(proxy->path) >= sizeof(sa.sun_path)) {
+        warn("failed to create socket for %s", proxy->path);
+        goto failed;
+    }
+    strcpy(sa.sun_path, proxy->path);
+
+    /* left behind by an envoyd that didn't get to clean up */
+    unlink(proxy->path);
+
+    if (fchmod(fd, 0600) < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        lchown(proxy->path, uid, -1) < 0 || listen(fd, SOMAXCONN) < 0) {
+        warn("failed to listen on %s", proxy->path);
+        goto failed;
+    }
+
+    proxy->evt = event_add(fd, EPOLLIN, on_proxy, proxy);
+
+    /* clients reading the shared memory should see it too */
+    if (node && proxy_sock(&node->d, uid))
+        publish_agent(node);
+    return;
+
+failed:
+    if (fd >= 0)
+        close(fd);
+    proxy->retry = now() + PROXY_RETRY;
+}
+
+/* Start the agent and answer the client once it's up, or right away
+ * if it shouldn't wait */
+static void start_agent(struct client_t *client, enum agent type, bool wait)
+{
+    struct ucred cred = client->cred;
+    uid_t uid = cred.uid;
+
+    if (client->evt) {
+        event_del(client->evt);
+        client->evt = NULL;
+    }
+
+    if (type == AGENT_DEFAULT)
+        type = default_type;
+    else if (type < 0 || type >= agent_count) {
+        fprintf(stderr, "Request for unknown agent type %d from uid=%u.\n", type, uid);
+        send_message(client, ENVOY_FAILED, true);
+        return;
+    }
+
+    if (!wait) {
+        send_message(client, ENVOY_STARTED, true);
+        client = NULL;
+    }
+
+    struct spawn_t *spawn = spawn_agent(&cred, type);
+
+    if (!client)
+        return;
+    else if (!spawn) {
+        send_message(client, ENVOY_FAILED, true);
+        return;
+    }
+
+    client->next = spawn->waiters;
+    spawn->waiters = client;
+}
+
+/* Answer for every agent in the mask at once, starting the missing
+ * ones side by side when asked to */
+static void handle_batch(struct client_t *client, enum envoy_message message, unsigned mask)
+{
+    uid_t uid = client->cred.uid;
+    enum agent type;
+
+    struct batch_t *batch = calloc(1, sizeof(struct batch_t));
+    if (!batch)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    if (client->evt) {
+        event_del(client->evt);
+        client->evt = NULL;
+    }
+
+    /* held until every agent has been looked at */
+    batch->client = client;
+    batch->mask = mask & ENVOY_ALL_AGENTS;
+    batch->pending = 1;
+
+    for (type = 0; type < agent_count; ++type) {
+        struct agent_data_t *data = &batch->d[type];
+        struct spawn_t *spawn;
+
+        if (!(batch->mask & ENVOY_AGENT_BIT(type)))
+            continue;
+
+        proxy_listen(uid, type);
+        uint64_t start = now_ns();
+        struct agent_info_t *node = registry_lookup(&agents, uid, type);
+        record_timing(ENVOY_PHASE_LOOKUP, start);
+
+        if (node)
+            node->last_used = now();
+
+        if (node && node->d.status == ENVOY_RUNNING) {
+            resolve_home(node);
+            *data = node->d;
+            continue;
+        }
+
+        *data = (struct agent_data_t){ .type = type, .status = ENVOY_STOPPED };
+        if (message == ENVOY_MSG_START) {
+            spawn = spawn_agent(&client->cred, type);
+            if (!spawn) {
+                data->status = ENVOY_FAILED;
+                continue;
+            }
+
+            batch->next[type] = spawn->batches;
+            spawn->batches = batch;
+            ++batch->pending;
+        } else if (message == ENVOY_MSG_PRESTART && prestart[type]) {
+            data->status = spawn_agent(&client->cred, type) ? ENVOY_STARTED : ENVOY_FAILED;
+        }
+    }
+
+    batch_resolved(batch);
+}
+
+static void send_stats(struct client_t *client)
+{
+    struct envoy_stats_t stats;
+    char buf[ENVOY_MAX_MESSAGE];
+
+    collect_stats(&stats);
+    ssize_t len = envoy_encode_stats(buf, sizeof(buf), &stats, client->version);
+
+    if (len < 0) {
+        errno = (int)-len;
+        warn("failed to encode stats");
+    } else if (send(client->fd, buf, len, MSG_NOSIGNAL) < 0) {
+        warn("failed to write stats");
+    }
+    client_free(client);
+}
+
+/* Any traffic from a watcher is ignored, it's only ever expected to
+ * hang up */
+static void on_watcher(struct event_t *evt, uint32_t events)
+{
+    char buf[64];
+    (void)events;
+
+    ssize_t nbytes_r = recv(evt->fd, buf, sizeof(buf), 0);
+    if (nbytes_r == 0 || (nbytes_r < 0 && errno != EAGAIN && errno != EINTR))
+        unwatch(evt->data);
+}
+
+/* Keep the connection open and push the agent's state down it, starting
+ * with the current one */
+static void subscribe(struct client_t *client, enum agent type, const struct agent_info_t *node)
+{
+    struct agent_data_t d = { .type = type, .status = ENVOY_STOPPED };
+
+    if (client->evt)
+        event_del(client->evt);
+    client->evt = event_add(client->fd, EPOLLIN, on_watcher, client);
+
+    client->watching = type;
+    client->next = watchers;
+    watchers = client;
+
+    send_agent(client, node ? &node->d : &d, false);
+}
+
+/* Agents from agents.conf are numbered in the order the file lists
+ * them, a client that read different names means different agents */
+static bool same_agents(const struct envoy_request_t *req, enum agent type)
+{
+    unsigned defined = req->agents;
+
+    if (type >= LAST_AGENT && type < agent_count)
+        defined |= ENVOY_AGENT_BIT(type);
+    defined &= ~(ENVOY_AGENT_BIT(LAST_AGENT) - 1);
+
+    return !defined || (req->has_config && req->config == agents_config);
 }
 
-static void cleanup(void)
+static void handle_request(struct client_t *client, const struct envoy_header_t *hdr)
 {
-    close(epoll_fd);
+    enum agent type = hdr->agent == AGENT_DEFAULT ? default_type : hdr->agent;
+    struct envoy_request_t req;
+    uint64_t start;
 
-    if (!sd_activated) {
-        close(server_sock);
-        unlink_envoy_socket();
+    count(ENVOY_COUNTER_REQUESTS);
+    if (!authorized(&client->cred)) {
+        send_message(client, ENVOY_BADUSER, true);
+        return;
     }
 
-    kill_agents(SIGTERM);
-}
+    if (hdr->message == ENVOY_MSG_STATS) {
+        send_stats(client);
+        return;
+    }
 
-static void sighandler(int signum)
-{
-    switch (signum) {
-    case SIGINT:
-    case SIGTERM:
-        cleanup();
-        exit(EXIT_SUCCESS);
+    envoy_decode_request(&req, &client->buf[sizeof(*hdr)], hdr->length);
+    if (!same_agents(&req, type)) {
+        fprintf(stderr, "Request from uid=%u doesn't share our agent definitions.\n",
+                client->cred.uid);
+        count(ENVOY_COUNTER_REJECTIONS);
+        send_message(client, ENVOY_BADCONFIG, true);
+        return;
     }
-}
 
-static bool unit_running(struct agent_data_t *data)
-{
-    bool running = true;
+    if (req.agents && hdr->message != ENVOY_MSG_WATCH) {
+        handle_batch(client, hdr->message, req.agents);
+        return;
+    }
 
-    if (data->unit_path[0]) {
-        char *state;
-        get_unit_state(bus, data->unit_path, &state);
-        running = strcmp(state, "running") == 0;
-    } else if (kill(data->pid, 0) < 0) {
-        if (errno != ESRCH)
-            err(EXIT_FAILURE, "something strange happened with kill");
-        running = false;
+    if (type < 0 || type >= agent_count) {
+        start_agent(client, type, true);
+        return;
     }
 
-    return running;
-}
+    proxy_listen(client->cred.uid, type);
 
-static int safe_atoi(const char *p, size_t len)
-{
-    int value = 0;
+    start = now_ns();
+    struct agent_info_t *node = registry_lookup(&agents, client->cred.uid, type);
+    record_timing(ENVOY_PHASE_LOOKUP, start);
 
-    for (; len && *p; ++p, --len) {
-        value *= 10;
-        value += *p - '0';
+    /* watching doesn't count as using the agent */
+    if (hdr->message == ENVOY_MSG_WATCH) {
+        subscribe(client, type, node);
+        return;
     }
 
-    return value;
+    if (node)
+        node->last_used = now();
+
+    if (node && node->d.status == ENVOY_RUNNING) {
+        resolve_home(node);
+        send_agent(client, &node->d, true);
+    } else if (hdr->message == ENVOY_MSG_START) {
+        start_agent(client, type, true);
+    } else if (hdr->message == ENVOY_MSG_PRESTART && prestart[type]) {
+        start_agent(client, type, false);
+    } else {
+        send_message(client, ENVOY_STOPPED, true);
+    }
 }
 
-static void init_agent_environ(void)
+static void handle_legacy(struct client_t *client)
 {
-    extern char **environ;
-    char *path = NULL, *gnupghome = NULL;
-    int i;
+    client->version = ENVOY_PROTOCOL_LEGACY;
 
-    for (i = 0; environ[i]; ++i) {
-        if (strncmp(environ[i], "PATH=", 5) == 0)
-            path = environ[i];
-        else if (strncmp(environ[i], "GNUPGHOME=", 10) == 0)
-            gnupghome = environ[i];
+    count(ENVOY_COUNTER_REQUESTS);
+    if (!authorized(&client->cred)) {
+        send_message(client, ENVOY_BADUSER, true);
+        return;
     }
 
-    agent_env.arg.path = path ? path : "PATH=/usr/local/bin:/usr/bin/:/bin";
+    struct agent_info_t *node = lookup_user_agent(client->cred.uid);
 
-    if (!gnupghome)
-        return;
+    if (node) {
+        proxy_listen(node->uid, node->type);
+        node->last_used = now();
+    }
 
-    if (!multiuser_mode)
-        agent_env.arg.gnupghome = gnupghome;
+    /* if its not running, the client will follow up with the agent
+     * type to start */
+    if (!node || node->d.status != ENVOY_RUNNING)
+        send_message(client, ENVOY_STOPPED, false);
     else
-        fprintf(stderr, "warning: running as root and GNUPGHOME is set; ignoring.\n");
+        send_agent(client, &node->d, true);
 }
 
-static pid_t gpg_info_extract_pid(const char *gpg)
+/* Returns true if the client is still waiting on its request to be
+ * read, false once it has been handed off or closed. */
+static bool client_read(struct client_t *client)
 {
-    const char *div, *end;
+    struct envoy_header_t hdr;
+
+    ssize_t nbytes_r = recv(client->fd, &client->buf[client->len],
+                            sizeof(client->buf) - client->len, 0);
+    if (nbytes_r < 0 && (errno == EAGAIN || errno == EINTR))
+        return true;
+    else if (nbytes_r <= 0) {
+        client_free(client);
+        return false;
+    }
 
-    div = strchr(gpg, ':');
-    if (div == NULL) {
-        fprintf(stderr, "GPG_AGENT_INFO=%s doesn't contain the agent's pid\n", gpg);
-        return 0;
+    client->len += nbytes_r;
+
+    if (client->version == ENVOY_PROTOCOL_LEGACY) {
+        enum agent type;
+
+        if (client->len < sizeof(type))
+            return true;
+
+        memcpy(&type, client->buf, sizeof(type));
+        start_agent(client, type, true);
+        return false;
     }
 
-    end = strchr(++div, ':');
-    if (div == NULL) {
-        fprintf(stderr, "GPG_AGENT_INFO=%s doesn't contain protocol version\n", gpg);
-        return 0;
+    if (client->len < sizeof(hdr))
+        return true;
+
+    memcpy(&hdr, client->buf, sizeof(hdr));
+    if (hdr.magic != ENVOY_MAGIC || hdr.version <= ENVOY_PROTOCOL_LEGACY ||
+        hdr.length > sizeof(client->buf) - sizeof(hdr)) {
+        fprintf(stderr, "Malformed request from uid=%u.\n", client->cred.uid);
+        client_free(client);
+        return false;
+    } else if (client->len < sizeof(hdr) + hdr.length) {
+        return true;
+    }
+
+    if (client->timer) {
+        close(client->timer->fd);
+        event_del(client->timer);
+        client->timer = NULL;
     }
 
-    return safe_atoi(div, end - div);
+    client->version = hdr.version < ENVOY_PROTOCOL_VERSION ? hdr.version : ENVOY_PROTOCOL_VERSION;
+    handle_request(client, &hdr);
+    return false;
 }
 
-static void parse_agentdata_line(char *val, struct agent_data_t *info)
+static void on_client(struct event_t *evt, uint32_t events)
 {
-    char *eol, *var;
-
-    eol = strchr(val, ';');
-    if (eol)
-        *eol = '\0';
+    (void)events;
+    client_read(evt->data);
+}
 
-    if (strchr(val, '=') == NULL)
-        return;
+static void on_legacy_timer(struct event_t *evt, uint32_t events)
+{
+    struct client_t *client = evt->data;
+    (void)events;
 
-    var = strsep(&val, "=");
+    close(evt->fd);
+    event_del(evt);
+    client->timer = NULL;
 
-    if (strcmp(var, "SSH_AUTH_SOCK") == 0)
-        strcpy(info->sock, val);
-    else if (strcmp(var, "SSH_AGENT_PID") == 0)
-        info->pid = atoi(val);
-    else if (strcmp(var, "GPG_AGENT_INFO") == 0)
-        strcpy(info->gpg, val);
+    handle_legacy(client);
 }
 
-static int parse_agentdata(int fd, struct agent_data_t *data)
+/* Each uid belongs to one worker. Use the hash's high bits, as the
+ * low ones pick the slot inside the worker's registry. */
+static struct worker_t *worker_for(uid_t uid)
 {
-    char b[BUFSIZ];
-    char *l, *nl;
-    ssize_t bytes_r;
-
-    bytes_r = read(fd, b, sizeof(b));
-    if (bytes_r <= 0)
-        return bytes_r;
-
-    b[bytes_r] = '\0';
-    l = &b[0];
+    return &workers[(registry_hash(uid, 0) >> 32) % nworkers];
+}
 
-    while (l < &b[bytes_r]) {
-        nl = strchr(l, '\n');
-        if (!nl)
-            break;
+static void serve_client(struct client_t *client)
+{
+    client->evt = event_add(client->fd, EPOLLIN, on_client, client);
 
-        *nl = '\0';
-        parse_agentdata_line(l, data);
+    /* Clients speaking the current protocol send their request right
+     * after connecting, so it has usually arrived already. */
+    if (!client_read(client))
+        return;
 
-        l = nl + 1;
-    }
+    struct itimerspec its = { .it_value.tv_nsec = LEGACY_GRACE_NS };
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
-    if (data->pid == 0 && data->gpg) {
-        data->pid = gpg_info_extract_pid(data->gpg);
+    if (tfd < 0 || timerfd_settime(tfd, 0, &its, NULL) < 0) {
+        warn("failed to arm timer");
+        if (tfd >= 0)
+            close(tfd);
+        handle_legacy(client);
+        return;
     }
 
-    return 0;
+    client->timer = event_add(tfd, EPOLLIN, on_legacy_timer, client);
 }
 
-static void __attribute__((__noreturn__)) exec_agent(const struct agent_t *agent, uid_t uid, gid_t gid)
+static void accept_conn(void)
 {
-    dbus_message *m;
-    char *scope, *slice = NULL;
-    struct passwd *pwd;
+    socklen_t cred_len = sizeof(struct ucred);
+    struct client_t *client;
+    uint64_t start = now_ns();
+
+    int cfd = accept4(server_sock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (cfd < 0) {
+        /* another worker got to it first */
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        err(EXIT_FAILURE, "failed to accept connection");
+    }
+    record_timing(ENVOY_PHASE_ACCEPT, start);
 
-    if (multiuser_mode && uid != 0)
-        safe_asprintf(&slice, "user-%d.slice", uid);
-    safe_asprintf(&scope, "envoy-monitor-%d.scope", uid);
+    client = calloc(1, sizeof(struct client_t));
+    if (!client)
+        err(EXIT_FAILURE, "failed to allocate memory");
+    client->fd = cfd;
 
-    /* bus is set to CLOEXEC, so we need to open it again */
-    dbus_open(DBUS_AUTO, &bus);
-    scope_init(&m, scope, slice, "Envoy agent monitor", 0);
-    int rc = scope_commit(bus, m, NULL);
-    if (rc < 0) {
-        err(EXIT_FAILURE, "failed to start transient scope for agent: %s", bus->error);
+    start = now_ns();
+    if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &client->cred, &cred_len) < 0)
+        err(EXIT_FAILURE, "couldn't obtain credentials from unix domain socket");
+    record_timing(ENVOY_PHASE_CREDENTIALS, start);
+
+    struct worker_t *owner = worker_for(client->cred.uid);
+    if (owner == self) {
+        serve_client(client);
+    } else {
+        push_client(&owner->inbox, client);
+        wake(owner->wake_fd);
     }
-    dbus_close(bus);
+}
 
-    free(scope);
+static void on_server(struct event_t *evt, uint32_t events)
+{
+    (void)evt;
 
-    if (setresgid(gid, gid, gid) < 0 || setresuid(uid, uid, uid) < 0)
-        err(EXIT_FAILURE, "unable to drop to uid=%u gid=%u\n", uid, gid);
+    if (events & (EPOLLERR | EPOLLHUP))
+        errx(EXIT_FAILURE, "listening socket closed");
 
-    pwd = getpwuid(uid);
-    if (pwd == NULL || pwd->pw_dir == NULL)
-        err(EXIT_FAILURE, "failed to lookup passwd entry");
+    accept_conn();
+}
 
-    /* setup the most minimal environment */
-    safe_asprintf(&agent_env.arg.home, "HOME=%s", pwd->pw_dir);
+static void signal_agent(const struct agent_info_t *node, int signal)
+{
+    if (node->d.pid == 0)
+        return;
 
-    execve(agent->argv[0], agent->argv, agent_env.env);
-    err(EXIT_FAILURE, "failed to start %s", agent->name);
+    if (node->d.unit_path[0]) {
+        struct bus_request_t *req = new_bus_request(BUS_KILL_UNIT);
+
+        /* the bus thread falls back to it, and may outlive the node's */
+        if (node->pidfd >= 0)
+            req->pidfd = fcntl(node->pidfd, F_DUPFD_CLOEXEC, 0);
+        req->pid = node->d.pid;
+        req->signal = signal;
+        strcpy(req->unit_path, node->d.unit_path);
+        submit_bus_request(req);
+    } else {
+        signal_pid(node->pidfd, node->d.pid, signal);
+    }
 }
 
-static int run_agent(struct agent_data_t *data, uid_t uid, gid_t gid)
+/* Agents are worth keeping around while they hold keys. Runs in a
+ * child of its own, as the agent's user, so an agent that never answers
+ * can only hold up itself, and envoyd never talks to a socket the user
+ * chose with root's credentials. Exits 0 if the agent holds keys. */
+static void __attribute__((__noreturn__)) run_probe(const struct agent_info_t *node)
 {
-    const struct agent_t *agent = &Agent[data->type];
-    int fd[2], stat = 0, rc = 0;
+    struct ssh_identities_t ids;
+    bool loaded = false;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    close_fds_from(3);
+    alarm(PROBE_TIMEOUT);
+
+    /* resolved by the parent, see start_probe() */
+    if (multiuser_mode && (setgroups(node->ngroups, node->groups) < 0 ||
+                           setresgid(node->gid, node->gid, node->gid) < 0 ||
+                           setresuid(node->uid, node->uid, node->uid) < 0))
+        _exit(EXIT_FAILURE);
+
+    if (node->d.sock[0] && ssh_list_identities_owned(node->d.sock, node->uid, &ids) == 0) {
+        loaded = ids.count > 0;
+        ssh_free_identities(&ids);
+    }
 
-    data->status = ENVOY_STARTED;
-    data->sock[0] = '\0';
-    data->gpg[0] = '\0';
-    data->unit_path[0] = '\0';
+    if (!loaded && node->d.gpg[0]) {
+        struct gpg_t *gpg = gpg_agent_connection_owned(node->d.gpg, node->uid);
 
-    printf("Starting %s for uid=%u gid=%u.\n", agent->name, uid, gid);
-    fflush(stdout);
+        if (gpg) {
+            size_t i, count;
+            const struct keyinfo_t *keys = gpg_keyinfo(gpg, &count);
 
-    if (pipe(fd) < 0)
-        err(EXIT_FAILURE, "failed to create pipe");
+            for (i = 0; i < count && !loaded; ++i)
+                loaded = keys[i].cached;
+        }
+    }
 
-    pid_t pid = fork();
-    switch (pid) {
-    case -1:
-        err(EXIT_FAILURE, "failed to fork");
-        break;
-    case 0:
-        dup2(fd[1], STDOUT_FILENO);
-        close(fd[0]);
-        close(fd[1]);
+    _exit(loaded ? EXIT_SUCCESS : EXIT_FAILURE);
+}
 
-        exec_agent(agent, uid, gid);
-        break;
-    default:
-        break;
+static void reap_agent(struct agent_info_t *node)
+{
+    if (node->d.status == ENVOY_RUNNING) {
+        printf("Stopping idle %s for uid=%u.\n", Agent[node->type]->name, node->uid);
+        signal_agent(node, SIGTERM);
+        agent_stopped(node);
+        count(ENVOY_COUNTER_REAPED);
     }
 
-    if (wait(&stat) < 1)
-        err(EXIT_FAILURE, "failed to get process status");
+    registry_remove(&agents, node);
+    free(node->groups);
+    free(node);
+}
 
-    if (stat) {
-        rc = -1;
-        data->pid = 0;
-        data->status = ENVOY_FAILED;
+static bool reapable(const struct agent_info_t *node)
+{
+    return !node->spawn && !node->probe && node->last_used <= now() - idle_timeout;
+}
 
-        if (WIFEXITED(stat))
-            fprintf(stderr, "%s exited with status %d.\n",
-                    agent->name, WEXITSTATUS(stat));
-        if (WIFSIGNALED(stat))
-            fprintf(stderr, "%s terminated with signal %d.\n",
-                    agent->name, WTERMSIG(stat));
-    } else if (parse_agentdata(fd[0], data) < 0) {
-        err(EXIT_FAILURE, "failed to parse %s output", agent->name);
-    } else {
-        char *scope, *path;
-
-        safe_asprintf(&scope, "envoy-monitor-%d.scope", uid);
-
-        rc = get_unit_by_pid(bus, data->pid, &path);
-        if (rc < 0) {
-            fprintf(stderr, "Failed to find unit for %s: %s\n"
-                    "Falling back to a naive (and less reliable) "
-                    "method of process management...\n",
-                    agent->name, bus->error);
-        } else {
-            strcpy(data->unit_path, path);
-            free(path);
-        }
+static void on_probe_exit(struct event_t *evt, uint32_t events)
+{
+    struct agent_info_t *node = evt->data;
+    int stat = 0;
+    (void)events;
 
-        free(scope);
-    }
+    pid_t pid = waitpid(node->probe_pid, &stat, WNOHANG);
+    if (pid == 0)
+        return;
+    else if (pid < 0)
+        err(EXIT_FAILURE, "failed to get process status");
 
-    close(fd[0]);
-    close(fd[1]);
-    return rc;
+    close(evt->fd);
+    event_del(evt);
+    node->probe = NULL;
+
+    /* whatever happened to the agent while it was asked, it'll be seen
+     * to on the next pass */
+    if (WIFEXITED(stat) && WEXITSTATUS(stat) == EXIT_SUCCESS)
+        return;
+    if (WIFSIGNALED(stat) && WTERMSIG(stat) == SIGALRM)
+        warnx("%s for uid=%u didn't list its keys in time", Agent[node->type]->name, node->uid);
+    if (reapable(node))
+        reap_agent(node);
 }
 
-static int get_socket(void)
+/* Returns false if the agent can be reaped right away. Otherwise it's
+ * being asked about its keys, if the user asked for that by creating
+ * KEEP_LOADED_PATH, and the answer decides. */
+static bool start_probe(struct agent_info_t *node)
 {
-    int fd, n;
-
-    n = sd_listen_fds(0);
-    if (n > 1)
-        err(EXIT_FAILURE, "too many file descriptors recieved");
-    else if (n == 1) {
-        fd = SD_LISTEN_FDS_START;
-        sd_activated = true;
-    } else {
-        union {
-            struct sockaddr sa;
-            struct sockaddr_un un;
-        } sa;
-        socklen_t sa_len;
+    char path[PATH_MAX];
 
-        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-        if (fd < 0)
-            err(EXIT_FAILURE, "couldn't create socket");
+    snprintf(path, sizeof(path), KEEP_LOADED_PATH, node->uid);
+    if (access(path, F_OK) < 0)
+        return false;
 
-        sa_len = init_envoy_socket(&sa.un);
-        if (bind(fd, &sa.sa, sa_len) < 0)
-            err(EXIT_FAILURE, "failed to bind");
+    /* the child can't take the locks a passwd lookup might, so it's
+     * done here. Without it, there's no telling, keep the agent. */
+    if (multiuser_mode && !resolve_home(node))
+        return true;
 
-        if (sa.un.sun_path[0] != '@')
-            chmod(sa.un.sun_path, multiuser_mode ? 0777 : 0700);
+    pid_t pid = fork();
+    if (pid < 0) {
+        warn("failed to fork");
+        return true;
+    } else if (pid == 0) {
+        run_probe(node);
+    }
 
-        if (listen(fd, SOMAXCONN) < 0)
-            err(EXIT_FAILURE, "failed to listen");
+    int pidfd = sys_pidfd_open(pid);
+    if (pidfd < 0) {
+        /* no way to wait on it without blocking, keep the agent */
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return true;
     }
 
-    return fd;
+    node->probe_pid = pid;
+    node->probe = event_add(pidfd, EPOLLIN, on_probe_exit, node);
+    return true;
 }
 
-static struct agent_info_t *lookup_agent_info(struct agent_info_t *list, uid_t uid)
+static void reap_idle(void)
 {
     struct agent_info_t *node;
-    for (node = list; node; node = node->next) {
-        if (node->uid == uid)
-            return node;
-    }
+    size_t iter = 0;
 
-    return NULL;
+    while ((node = registry_next(&agents, &iter))) {
+        if (!reapable(node))
+            continue;
+
+        if (node->d.status == ENVOY_RUNNING && start_probe(node))
+            continue;
+
+        reap_agent(node);
+    }
 }
 
-static void send_agent(int fd, struct agent_data_t *agent, bool close_sock)
+static void on_idle_timer(struct event_t *evt, uint32_t events)
 {
-    if (write(fd, agent, sizeof(struct agent_data_t)) < 0)
-        err(EXIT_FAILURE, "failed to write agent data");
-    if (close_sock)
-        close(fd);
+    uint64_t expirations;
+    (void)events;
+
+    if (read(evt->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        warn("failed to read idle timer");
+
+    reap_idle();
 }
 
-static void send_message(int fd, enum status status, bool close_sock)
+static void start_idle_timer(void)
 {
-    struct agent_data_t d = { .status = status };
-    send_agent(fd, &d, close_sock);
+    /* check often enough that agents don't outlive the timeout by much */
+    time_t interval = idle_timeout > 120 ? 60 : (idle_timeout + 1) / 2;
+    struct itimerspec spec = {
+        .it_interval = { .tv_sec = interval },
+        .it_value    = { .tv_sec = interval }
+    };
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd < 0)
+        err(EXIT_FAILURE, "failed to create idle timer");
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0)
+        err(EXIT_FAILURE, "failed to arm idle timer");
+
+    event_add(fd, EPOLLIN, on_idle_timer, NULL);
 }
 
-static void accept_conn(void)
+static bool read_string(FILE *fp, char *dest, size_t len)
 {
-    struct ucred cred;
-    union {
-        struct sockaddr sa;
-        struct sockaddr_un un;
-    } sa;
-    static socklen_t sa_len = sizeof(struct sockaddr_un);
-    static socklen_t cred_len = sizeof(struct ucred);
-    uid_t server_uid = geteuid();
+    if (len >= PATH_MAX || fread(dest, 1, len, fp) != len)
+        return false;
 
-    int cfd = accept4(server_sock, &sa.sa, &sa_len, SOCK_CLOEXEC);
-    if (cfd < 0)
-        err(EXIT_FAILURE, "failed to accept connection");
+    dest[len] = '\0';
+    return true;
+}
 
-    if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
-        err(EXIT_FAILURE, "couldn't obtain credentials from unix domain socket");
+static void load_state_file(const char *path)
+{
+    struct state_header_t hdr;
+    struct state_record_t record;
+
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        warn("failed to open %s", path);
+        return;
+    }
 
-    if (server_uid != 0 && server_uid != cred.uid) {
-        fprintf(stderr, "Connection from uid=%u rejected.\n", cred.uid);
-        send_message(cfd, ENVOY_BADUSER, true);
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        hdr.magic != STATE_MAGIC || hdr.version != STATE_VERSION) {
+        warnx("ignoring unrecognized state file %s", path);
+        fclose(fp);
         return;
     }
 
-    struct agent_info_t *node = lookup_agent_info(agents, cred.uid);
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        struct agent_info_t *node;
+
+        if (record.type < 0 || record.type >= agent_count)
+            break;
 
-    if (!node || node->d.pid == 0 || !unit_running(&node->d)) {
-        struct epoll_event event = {
-            .data.fd = cfd,
-            .events  = EPOLLIN | EPOLLET
+        node = realloc(restored, (restored_count + 1) * sizeof(struct agent_info_t));
+        if (!node)
+            err(EXIT_FAILURE, "failed to allocate memory");
+        restored = node;
+
+        node = &restored[restored_count];
+        *node = (struct agent_info_t){
+            .uid        = record.uid,
+            .type       = record.type,
+            .start_time = record.start_time,
+            .d = {
+                .type   = record.type,
+                .status = ENVOY_RUNNING,
+                .pid    = record.pid
+            }
         };
 
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cfd, &event) < 0)
-            err(EXIT_FAILURE, "failed to add socket to epoll");
+        if (!read_string(fp, node->d.sock, record.sock_len) ||
+            !read_string(fp, node->d.gpg, record.gpg_len) ||
+            !read_string(fp, node->d.unit_path, record.unit_len))
+            break;
 
-        if (node)
-            node->d.pid = 0;
+        ++restored_count;
+    }
 
-        send_message(cfd, ENVOY_STOPPED, false);
-    } else {
-        send_agent(cfd, &node->d, true);
+    fclose(fp);
+}
+
+/* Read what the previous envoyd left behind. Workers pick out their
+ * own agents as they start, and overwrite their files. */
+static void load_state(void)
+{
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    if (mkdir(state_dir, 0700) < 0 && errno != EEXIST)
+        err(EXIT_FAILURE, "failed to create %s", state_dir);
+
+    DIR *dir = opendir(state_dir);
+    if (!dir)
+        err(EXIT_FAILURE, "failed to open %s", state_dir);
+
+    while ((entry = readdir(dir))) {
+        char *end;
+
+        if (strncmp(entry->d_name, "worker-", 7) != 0)
+            continue;
+
+        size_t index = strtoul(entry->d_name + 7, &end, 10);
+        if (*end)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", state_dir, entry->d_name);
+        load_state_file(path);
+
+        /* nobody is going to overwrite this one */
+        if (index >= nworkers)
+            unlink(path);
     }
+
+    closedir(dir);
 }
 
-static void handle_conn(int cfd)
+static void adopt_agents(void)
 {
-    struct ucred cred;
-    static socklen_t cred_len = sizeof(struct ucred);
-    enum agent type;
+    size_t i;
 
-    int nbytes_r = read(cfd, &type, sizeof(enum agent));
-    if (nbytes_r < 0)
-        err(EXIT_FAILURE, "couldn't read agent type to start");
+    for (i = 0; i < restored_count; ++i) {
+        const struct agent_info_t *saved = &restored[i];
 
-    if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
-        err(EXIT_FAILURE, "couldn't obtain credentials from unix domain socket");
+        if (worker_for(saved->uid) != self)
+            continue;
 
-    struct agent_info_t *node = lookup_agent_info(agents, cred.uid);
+        /* make sure it's still the same process */
+        if (proc_start_time(saved->d.pid, saved->uid) != saved->start_time)
+            continue;
 
-    if (!node) {
-        node = calloc(1, sizeof(struct agent_info_t));
-        node->uid = cred.uid;
-        node->next = agents;
-        agents = node;
-    } else {
-        printf("Agent for uid=%u is has terminated. Restarting...\n", cred.uid);
+        struct agent_info_t *node = registry_insert(&agents, saved->uid, saved->type);
+        node->d = saved->d;
+        node->start_time = saved->start_time;
+        node->last_used = now();
+        resolve_home(node);
+
+        printf("Adopted %s for uid=%u pid=%d.\n", Agent[node->type]->name,
+               node->uid, node->d.pid);
         fflush(stdout);
+
+        watch_agent(node);
+        publish_agent(node);
+        proxy_listen(node->uid, node->type);
+    }
+
+    save_state();
+}
+
+static void on_wake(struct event_t *evt, uint32_t events)
+{
+    struct worker_t *worker = evt->data;
+    struct client_t *client;
+    struct bus_request_t *req;
+    uint64_t count;
+    (void)events;
+
+    if (read(evt->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        warn("failed to read wakeup");
+
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        stop_worker();
+        pthread_exit(NULL);
     }
 
-    node->d.type = type != AGENT_DEFAULT ? type : default_type;
+    for (client = take_clients(&worker->inbox); client;) {
+        struct client_t *next = client->next;
+
+        client->next = NULL;
+        serve_client(client);
+        client = next;
+    }
 
-    run_agent(&node->d, cred.uid, cred.gid);
-    send_agent(cfd, &node->d, true);
+    for (req = take_requests(&worker->replies); req;) {
+        struct bus_request_t *next = req->next;
 
-    if (node->d.pid)
-        node->d.status = ENVOY_RUNNING;
+        req->done(req);
+        req = next;
+    }
 }
 
-static int loop(void)
+static void *loop(void *arg)
 {
-    struct epoll_event events[4], event = {
-        .data.fd = server_sock,
-        .events  = EPOLLIN | EPOLLET
-    };
+    struct epoll_event events[4];
+
+    self = arg;
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &event) < 0)
-        err(EXIT_FAILURE, "failed to add socket to epoll");
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        err(EXIT_FAILURE, "failed to start epoll");
+
+    /* let the kernel wake only one worker per connection */
+    event_add(server_sock, nworkers > 1 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN, on_server, NULL);
+    event_add(self->wake_fd, EPOLLIN, on_wake, self);
+    if (nworkers == 1)
+        event_add(signal_fd, EPOLLIN, on_signal, NULL);
+    if (idle_timeout)
+        start_idle_timer();
+    if (state_dir)
+        adopt_agents();
 
     while (true) {
         int i, n = epoll_wait(epoll_fd, events, 4, -1);
@@ -483,18 +3196,111 @@ static int loop(void)
         }
 
         for (i = 0; i < n; ++i) {
-            struct epoll_event *evt = &events[i];
-
-            if (evt->events & EPOLLERR || evt->events & EPOLLHUP)
-                close(evt->data.fd);
-            else if (evt->data.fd == server_sock)
-                accept_conn();
-            else
-                handle_conn(evt->data.fd);
+            struct event_t *evt = events[i].data.ptr;
+
+            if (evt->fd >= 0)
+                evt->fn(evt, events[i].events);
+        }
+
+        while (dead_events) {
+            struct event_t *evt = dead_events;
+            dead_events = evt->next;
+            free(evt);
         }
     }
 
-    return 0;
+    return NULL;
+}
+
+static void start_workers(void)
+{
+    size_t i;
+
+    workers = calloc(nworkers, sizeof(struct worker_t));
+    if (!workers)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    for (i = 0; i < nworkers; ++i) {
+        workers[i].wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (workers[i].wake_fd < 0)
+            err(EXIT_FAILURE, "failed to create eventfd");
+    }
+
+    if (nworkers == 1) {
+        loop(&workers[0]);
+        return;
+    }
+
+    bus_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (bus_wake_fd < 0)
+        err(EXIT_FAILURE, "failed to create eventfd");
+
+    /* workers have nonblocking accepts */
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) | O_NONBLOCK);
+
+    for (i = 0; i < nworkers; ++i) {
+        errno = pthread_create(&workers[i].thread, NULL, loop, &workers[i]);
+        if (errno != 0)
+            err(EXIT_FAILURE, "failed to start worker");
+    }
+
+    bus_loop();
+}
+
+/* [AGENT:]PROPERTY=VALUE, in the units systemd takes for the property */
+static void parse_limit(char *arg)
+{
+    unsigned mask = ENVOY_ALL_AGENTS;
+    char value[32], *end;
+    enum agent type;
+    size_t i;
+
+    char *eq = strchr(arg, '=');
+    char *colon = strchr(arg, ':');
+    if (!eq)
+        errx(EXIT_FAILURE, "invalid limit: %s", arg);
+    *eq = '\0';
+
+    if (colon && colon < eq) {
+        *colon = '\0';
+        type = lookup_agent(arg);
+        if (type == AGENT_MAX)
+            errx(EXIT_FAILURE, "unknown agent: %s", arg);
+        mask = ENVOY_AGENT_BIT(type);
+        arg = colon + 1;
+    }
+
+    for (i = 0; i < LIMIT_MAX; ++i)
+        if (strcmp(arg, Limit[i].property) == 0)
+            break;
+    if (i == LIMIT_MAX)
+        errx(EXIT_FAILURE, "unknown limit: %s", arg);
+
+    const char *str = eq + 1;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+
+    if (strcmp(str, "infinity") == 0 && (i == LIMIT_MEMORY || i == LIMIT_TASKS)) {
+        strcpy(value, "max");
+    } else if (errno || end == str) {
+        errx(EXIT_FAILURE, "invalid value for %s: %s", arg, str);
+    } else if (i == LIMIT_MEMORY) {
+        const char *suffixes = "KMGT", *suffix = *end ? strchr(suffixes, *end) : NULL;
+
+        if (*end && (!suffix || end[1]))
+            errx(EXIT_FAILURE, "invalid value for %s: %s", arg, str);
+        if (suffix)
+            n <<= 10 * (suffix - suffixes + 1);
+        snprintf(value, sizeof(value), "%llu", n);
+    } else if (*end || (i != LIMIT_TASKS && (n < 1 || n > 10000))) {
+        errx(EXIT_FAILURE, "invalid value for %s: %s", arg, str);
+    } else {
+        snprintf(value, sizeof(value), i == LIMIT_IO ? "default %llu" : "%llu", n);
+    }
+
+    for (type = 0; type < agent_count; ++type)
+        if (mask & ENVOY_AGENT_BIT(type))
+            strcpy(limits[type][i], value);
 }
 
 static void __attribute__((__noreturn__)) usage(FILE *out)
@@ -503,7 +3309,17 @@ static void __attribute__((__noreturn__)) usage(FILE *out)
     fputs("Options:\n"
         " -h, --help            display this help and exit\n"
         " -v, --version         display version\n"
-        " -t, --agent=AGENT     set the agent to start\n", out);
+        " -t, --agent=AGENT     set the agent to start\n"
+        " -p, --prestart=AGENT  let clients start AGENT without waiting\n"
+        " -i, --idle-timeout=SECONDS\n"
+        "                       stop agents that haven't been used in SECONDS\n"
+        " -j, --threads=N       serve clients from N worker threads\n"
+        " -s, --state-dir=DIR   keep agents running across restarts, tracked in DIR\n"
+        " -P, --proxy           hand out sockets that relay to the agents, so they\n"
+        "                       stay the same when agents are restarted\n"
+        " -l, --limit=[AGENT:]PROPERTY=VALUE\n"
+        "                       set MemoryMax, CPUWeight, TasksMax or IOWeight on\n"
+        "                       the agents' scopes\n", out);
 
     exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -511,14 +3327,29 @@ static void __attribute__((__noreturn__)) usage(FILE *out)
 int main(int argc, char *argv[])
 {
     static const struct option opts[] = {
-        { "help",    no_argument,       0, 'h' },
-        { "version", no_argument,       0, 'v' },
-        { "agent",   required_argument, 0, 't' },
+        { "help",     no_argument,       0, 'h' },
+        { "version",  no_argument,       0, 'v' },
+        { "agent",    required_argument, 0, 't' },
+        { "prestart", required_argument, 0, 'p' },
+        { "idle-timeout", required_argument, 0, 'i' },
+        { "threads",  required_argument, 0, 'j' },
+        { "state-dir", required_argument, 0, 's' },
+        { "proxy",    no_argument,       0, 'P' },
+        { "limit",    required_argument, 0, 'l' },
         { 0, 0, 0, 0 }
     };
+    enum agent type;
+    sigset_t mask;
+    char *end;
+
+    /* before the options, which can name these agents */
+    int rc = load_agents(NULL);
+    if (rc < 0)
+        errx(EXIT_FAILURE, "failed to read agent definitions: %s", strerror(-rc));
+    agents_config = envoy_agents_config();
 
     while (true) {
-        int opt = getopt_long(argc, argv, "hvt:", opts, NULL);
+        int opt = getopt_long(argc, argv, "hvt:p:i:j:s:Pl:", opts, NULL);
         if (opt == -1)
             break;
 
@@ -531,28 +3362,60 @@ int main(int argc, char *argv[])
             return 0;
         case 't':
             default_type = lookup_agent(optarg);
-            if (default_type == LAST_AGENT)
+            if (default_type == AGENT_MAX)
+                errx(EXIT_FAILURE, "unknown agent: %s", optarg);
+            break;
+        case 'p':
+            type = lookup_agent(optarg);
+            if (type == AGENT_MAX)
                 errx(EXIT_FAILURE, "unknown agent: %s", optarg);
+            prestart[type] = true;
+            break;
+        case 'i':
+            errno = 0;
+            idle_timeout = strtol(optarg, &end, 10);
+            if (errno || *end || idle_timeout <= 0)
+                errx(EXIT_FAILURE, "invalid idle timeout: %s", optarg);
+            break;
+        case 'j':
+            errno = 0;
+            nworkers = strtoul(optarg, &end, 10);
+            if (errno || *end || nworkers == 0 || nworkers > 1024)
+                errx(EXIT_FAILURE, "invalid number of threads: %s", optarg);
+            break;
+        case 's':
+            state_dir = optarg;
+            break;
+        case 'P':
+            proxy_mode = true;
+            break;
+        case 'l':
+            parse_limit(optarg);
             break;
         default:
             usage(stderr);
         }
     }
 
-    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-    if (epoll_fd < 0)
-        err(EXIT_FAILURE, "failed to start epoll");
-
     multiuser_mode = (getuid() == 0) ? true : false;
 
-    dbus_open(DBUS_AUTO, &bus);
     server_sock = get_socket();
     init_agent_environ();
+    if (state_dir)
+        load_state();
 
-    signal(SIGTERM, sighandler);
-    signal(SIGINT,  sighandler);
+    /* blocked before any threads exist, so every one inherits it */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
 
-    return loop();
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0)
+        err(EXIT_FAILURE, "failed to create signalfd");
+
+    start_workers();
+    return 0;
 }
 
 // vim: et:sts=4:sw=4:cino=(0
@@ -0,0 +1,55 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2013
+ */
+
+#ifndef AGENT_OUTPUT_H
+#define AGENT_OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "envoy.h"
+
+/* Incremental parser for the environment an agent prints as it starts,
+ * in sh (VAR=value; export VAR;) or csh (setenv VAR value;) syntax. It
+ * can be fed the output in pieces of any size, filling in the agent's
+ * socket, pid and GPG_AGENT_INFO as soon as each line is complete. The
+ * agent's definition says which variables hold its socket and pid. */
+struct agent_output_t {
+    const struct agent_t *agent;
+    int cs;
+    int var;
+    size_t name_len;
+    size_t len;
+    char name[32];
+    char value[PATH_MAX];
+};
+
+void agent_output_init(struct agent_output_t *parser, const struct agent_t *agent);
+void agent_output_feed(struct agent_output_t *parser, const char *buf, size_t len,
+                       struct agent_data_t *data);
+
+/* Called at EOF, for a last line without a newline */
+void agent_output_finish(struct agent_output_t *parser, struct agent_data_t *data);
+
+/* Whether the agent printed all its definition says it will: its
+ * socket, and its pid unless it doesn't print one. GPG_AGENT_INFO is
+ * never waited on, gpg-agent 2.1 and later don't print it. */
+bool agent_output_ready(const struct agent_t *agent, const struct agent_data_t *data);
+
+#endif
+
+// vim: et:sts=4:sw=4:cino=(0
@@ -0,0 +1,158 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2013
+ */
+
+#include "agent-output.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+enum {
+    VAR_NONE,
+    VAR_SOCK,
+    VAR_PID,
+    VAR_GPG
+};
+
+static bool is_var(const struct agent_output_t *parser, const char *name)
+{
+    return strlen(name) == parser->name_len && memcmp(name, parser->name, parser->name_len) == 0;
+}
+
+/* The agent's definition can rename the socket and pid variables */
+static int lookup_var(const struct agent_output_t *parser)
+{
+    const struct agent_t *agent = parser->agent;
+
+    if (is_var(parser, agent->sock_env ? agent->sock_env : "SSH_AUTH_SOCK"))
+        return VAR_SOCK;
+    if (is_var(parser, agent->pid_env ? agent->pid_env : "SSH_AGENT_PID"))
+        return VAR_PID;
+    if (is_var(parser, "GPG_AGENT_INFO"))
+        return VAR_GPG;
+    return VAR_NONE;
+}
+
+/* GPG_AGENT_INFO is path:pid:protocol */
+static pid_t gpg_info_extract_pid(const char *gpg)
+{
+    const char *div = strchr(gpg, ':');
+
+    if (!div || !strchr(div + 1, ':')) {
+        fprintf(stderr, "GPG_AGENT_INFO=%s doesn't contain the agent's pid\n", gpg);
+        return 0;
+    }
+
+    return atoi(div + 1);
+}
+
+static void store_value(struct agent_output_t *parser, struct agent_data_t *data)
+{
+    char *value = parser->value;
+    size_t len = parser->len;
+
+    /* neither agent quotes its values, but don't choke if one does */
+    if (len >= 2 && (value[0] == '\'' || value[0] == '"') && value[len - 1] == value[0]) {
+        ++value;
+        len -= 2;
+    }
+    value[len] = '\0';
+
+    switch (parser->var) {
+    case VAR_SOCK:
+        snprintf(data->sock, sizeof(data->sock), "%s", value);
+        break;
+    case VAR_PID:
+        data->pid = atoi(value);
+        break;
+    case VAR_GPG:
+        snprintf(data->gpg, sizeof(data->gpg), "%s", value);
+        /* the pid variable wins, whichever order they come in */
+        if (!data->pid)
+            data->pid = gpg_info_extract_pid(data->gpg);
+        break;
+    }
+
+    parser->var = VAR_NONE;
+}
+
+%%{
+    machine agent_output;
+    access parser->;
+
+    action name_start {
+        parser->var = VAR_NONE;
+        parser->name_len = 0;
+    }
+    action name_char {
+        if (parser->name_len < sizeof(parser->name))
+            parser->name[parser->name_len++] = fc;
+    }
+    action name_end {
+        parser->var = lookup_var(parser);
+        parser->len = 0;
+    }
+    action value_char {
+        /* an overlong value is dropped rather than cut short */
+        if (parser->len < sizeof(parser->value) - 1)
+            parser->value[parser->len++] = fc;
+        else
+            parser->var = VAR_NONE;
+    }
+    action value_end { store_value(parser, data); }
+
+    name = ( [A-Za-z_] [A-Za-z0-9_]* ) >name_start $name_char %name_end;
+    value = [^;\n]* $value_char %value_end;
+    rest = ( ';' [^\n]* )? '\n';
+
+    sh = name '=' value rest;
+    csh = 'setenv' ' '+ name ' '+ value rest;
+
+    # anything else, like ssh-agent's "echo Agent pid 42;", is skipped
+    main := ( sh | csh | [^\n]* '\n' )*;
+}%%
+
+%%write data;
+
+void agent_output_init(struct agent_output_t *parser, const struct agent_t *agent)
+{
+    *parser = (struct agent_output_t){ .agent = agent, .var = VAR_NONE };
+    %%write init;
+}
+
+void agent_output_feed(struct agent_output_t *parser, const char *buf, size_t len,
+                       struct agent_data_t *data)
+{
+    const char *p = buf, *pe = buf + len;
+
+    %%write exec;
+}
+
+void agent_output_finish(struct agent_output_t *parser, struct agent_data_t *data)
+{
+    agent_output_feed(parser, "\n", 1, data);
+}
+
+bool agent_output_ready(const struct agent_t *agent, const struct agent_data_t *data)
+{
+    if (!data->sock[0])
+        return false;
+    return data->pid || (agent->pid_env && !agent->pid_env[0]);
+}
+
+// vim: et:sts=4:sw=4:cino=(0
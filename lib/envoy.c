@@ -21,24 +21,68 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
 #include <errno.h>
 #include <err.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 
-const struct agent_t Agent[LAST_AGENT] = {
+static const struct agent_t builtin_agents[LAST_AGENT] = {
     [AGENT_SSH_AGENT] = {
         .name = "ssh-agent",
         .argv = (char *const []){ "/usr/bin/ssh-agent", NULL }
     },
     [AGENT_GPG_AGENT] = {
         .name = "gpg-agent",
-        .argv = (char *const []){ "/usr/bin/gpg-agent", "--daemon", "--enable-ssh-support", NULL }
+        .argv = (char *const []){ "/usr/bin/gpg-agent", "--daemon", "--enable-ssh-support", NULL },
+        /* only GPG_AGENT_INFO carried it, and 2.1 dropped that too */
+        .pid_env = ""
     }
 };
 
-static const char *get_socket_path(void)
+static struct agent_t defined_agents[AGENT_MAX - LAST_AGENT];
+
+static const struct agent_t *agent_table[AGENT_MAX] = {
+    [AGENT_SSH_AGENT] = &builtin_agents[AGENT_SSH_AGENT],
+    [AGENT_GPG_AGENT] = &builtin_agents[AGENT_GPG_AGENT]
+};
+
+const struct agent_t *const *const Agent = agent_table;
+
+int agent_count = LAST_AGENT;
+
+_Static_assert(sizeof(struct envoy_header_t) + sizeof(struct envoy_field_t) + sizeof(int32_t) +
+               ENVOY_MAX_MESSAGE <= ENVOY_MAX_BATCH, "a batch must have room for any one agent");
+
+const char *const envoy_counter_names[ENVOY_COUNTER_MAX] = {
+    [ENVOY_COUNTER_REQUESTS]   = "requests",
+    [ENVOY_COUNTER_STARTS]     = "starts",
+    [ENVOY_COUNTER_RESTARTS]   = "restarts",
+    [ENVOY_COUNTER_REJECTIONS] = "rejections",
+    [ENVOY_COUNTER_FAILURES]   = "failures",
+    [ENVOY_COUNTER_REAPED]     = "reaped"
+};
+
+const char *const envoy_phase_names[ENVOY_PHASE_MAX] = {
+    [ENVOY_PHASE_ACCEPT]      = "accept",
+    [ENVOY_PHASE_CREDENTIALS] = "credentials",
+    [ENVOY_PHASE_LOOKUP]      = "lookup",
+    [ENVOY_PHASE_FORK]        = "fork",
+    [ENVOY_PHASE_SCOPE]       = "scope",
+    [ENVOY_PHASE_PARSE]       = "parse",
+    [ENVOY_PHASE_REPLY]       = "reply",
+    [ENVOY_PHASE_SPAWN]       = "spawn"
+};
+
+const char *get_socket_path(void)
 {
     const char *socket = getenv("ENVOY_SOCKET");
     return socket ? socket : "@/vodik/envoy";
@@ -68,29 +112,588 @@ void unlink_envoy_socket(void)
         unlink(socket);
 }
 
-static int read_agent(int fd, struct agent_data_t *data)
+static char *put_field(char *p, enum envoy_field tag, const void *value, size_t len)
 {
-    int nbytes_r;
+    struct envoy_field_t field = { .tag = tag, .length = len };
+
+    memcpy(p, &field, sizeof(field));
+    memcpy(p + sizeof(field), value, len);
+    return p + sizeof(field) + len;
+}
+
+static int get_string(char *dest, size_t size, const char *value, size_t len)
+{
+    if (len >= size)
+        return -EBADMSG;
+
+    memcpy(dest, value, len);
+    dest[len] = '\0';
+    return 0;
+}
+
+size_t envoy_encode_request(char *buf, enum agent id, enum envoy_message message)
+{
+    uint32_t config = envoy_agents_config();
+    char *p = put_field(buf + sizeof(struct envoy_header_t), ENVOY_FIELD_CONFIG,
+                        &config, sizeof(config));
+
+    struct envoy_header_t hdr = {
+        .agent   = id,
+        .magic   = ENVOY_MAGIC,
+        .version = ENVOY_PROTOCOL_VERSION,
+        .message = message,
+        .length  = p - buf - sizeof(struct envoy_header_t)
+    };
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    return p - buf;
+}
 
-    while (true) {
-        nbytes_r = read(fd, data, sizeof(*data));
+size_t envoy_encode_batch_request(char *buf, unsigned mask, enum envoy_message message)
+{
+    uint32_t agents = mask;
+    enum agent id = 0;
+
+    while (id < agent_count && !(mask & ENVOY_AGENT_BIT(id)))
+        ++id;
+
+    char *p = buf + envoy_encode_request(buf, id, message);
+    p = put_field(p, ENVOY_FIELD_AGENTS, &agents, sizeof(agents));
+
+    struct envoy_header_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    hdr.length = p - buf - sizeof(hdr);
+    memcpy(buf, &hdr, sizeof(hdr));
+    return p - buf;
+}
+
+/* agents is 0 if the request has no ENVOY_FIELD_AGENTS */
+void envoy_decode_request(struct envoy_request_t *req, const char *payload, size_t len)
+{
+    const char *p = payload, *end = payload + len;
+    uint32_t value;
+
+    *req = (struct envoy_request_t){ .agents = 0 };
+
+    while ((size_t)(end - p) >= sizeof(struct envoy_field_t)) {
+        struct envoy_field_t field;
+
+        memcpy(&field, p, sizeof(field));
+        p += sizeof(field);
+
+        if (field.length > end - p)
+            return;
+
+        if (field.length == sizeof(value)) {
+            memcpy(&value, p, sizeof(value));
+            if (field.tag == ENVOY_FIELD_AGENTS) {
+                req->agents = value;
+            } else if (field.tag == ENVOY_FIELD_CONFIG) {
+                req->has_config = true;
+                req->config = value;
+            }
+        }
+
+        p += field.length;
+    }
+}
+
+static size_t string_size(const char *value, size_t size)
+{
+    size_t len = strnlen(value, size);
+    return len ? sizeof(struct envoy_field_t) + len : 0;
+}
+
+/* What put_agent() will write */
+static size_t agent_size(const struct agent_data_t *data)
+{
+    return 2 * (sizeof(struct envoy_field_t) + sizeof(uint32_t)) +
+        string_size(data->sock, sizeof(data->sock)) +
+        string_size(data->gpg, sizeof(data->gpg)) +
+        string_size(data->home, sizeof(data->home));
+}
+
+static char *put_agent(char *p, const struct agent_data_t *data)
+{
+    uint32_t status = data->status;
+    int32_t pid = data->pid;
+    size_t sock_len = strnlen(data->sock, sizeof(data->sock));
+    size_t gpg_len = strnlen(data->gpg, sizeof(data->gpg));
+    size_t home_len = strnlen(data->home, sizeof(data->home));
+
+    p = put_field(p, ENVOY_FIELD_STATUS, &status, sizeof(status));
+    p = put_field(p, ENVOY_FIELD_PID, &pid, sizeof(pid));
+    if (sock_len)
+        p = put_field(p, ENVOY_FIELD_SOCK, data->sock, sock_len);
+    if (gpg_len)
+        p = put_field(p, ENVOY_FIELD_GPG, data->gpg, gpg_len);
+    if (home_len)
+        p = put_field(p, ENVOY_FIELD_HOME, data->home, home_len);
+
+    return p;
+}
+
+ssize_t envoy_encode_agent(char *buf, size_t size, const struct agent_data_t *data, int version)
+{
+    char *p = buf + sizeof(struct envoy_header_t);
+
+    if (size < ENVOY_MAX_MESSAGE)
+        return -ENOSPC;
+
+    p = put_agent(p, data);
+
+    struct envoy_header_t hdr = {
+        .agent   = data->type,
+        .magic   = ENVOY_MAGIC,
+        .version = version,
+        .message = ENVOY_MSG_AGENT,
+        .length  = p - buf - sizeof(struct envoy_header_t)
+    };
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    return p - buf;
+}
+
+int envoy_decode_agent(struct agent_data_t *data, const char *payload, size_t len)
+{
+    const char *p = payload, *end = payload + len;
+    uint32_t value;
+    int rc = 0;
+
+    while (rc == 0 && (size_t)(end - p) >= sizeof(struct envoy_field_t)) {
+        struct envoy_field_t field;
+
+        memcpy(&field, p, sizeof(field));
+        p += sizeof(field);
+
+        if (field.length > end - p)
+            return -EBADMSG;
+
+        switch (field.tag) {
+        case ENVOY_FIELD_STATUS:
+        case ENVOY_FIELD_PID:
+            if (field.length != sizeof(value))
+                return -EBADMSG;
+
+            memcpy(&value, p, sizeof(value));
+            if (field.tag == ENVOY_FIELD_STATUS)
+                data->status = value;
+            else
+                data->pid = value;
+            break;
+        case ENVOY_FIELD_SOCK:
+            rc = get_string(data->sock, sizeof(data->sock), p, field.length);
+            break;
+        case ENVOY_FIELD_GPG:
+            rc = get_string(data->gpg, sizeof(data->gpg), p, field.length);
+            break;
+        case ENVOY_FIELD_HOME:
+            rc = get_string(data->home, sizeof(data->home), p, field.length);
+            break;
+        default:
+            break;
+        }
+
+        p += field.length;
+    }
+
+    return rc;
+}
+
+ssize_t envoy_encode_batch(char *buf, size_t size, const struct agent_data_t *data, unsigned mask,
+                           int version)
+{
+    char *p = buf + sizeof(struct envoy_header_t);
+    const char *end = buf + (size < ENVOY_MAX_BATCH ? size : ENVOY_MAX_BATCH);
+    int32_t type;
+
+    if (size < sizeof(struct envoy_header_t))
+        return -ENOSPC;
+
+    for (type = 0; type < agent_count; ++type) {
+        struct envoy_field_t field = { .tag = ENVOY_FIELD_AGENT };
+        char *start = p;
+
+        if (!(mask & ENVOY_AGENT_BIT(type)))
+            continue;
+
+        /* the client asks about whatever is left out on its own */
+        if (sizeof(field) + sizeof(type) + agent_size(&data[type]) > (size_t)(end - p))
+            continue;
+
+        p += sizeof(field);
+        memcpy(p, &type, sizeof(type));
+        p = put_agent(p + sizeof(type), &data[type]);
+
+        field.length = p - start - sizeof(field);
+        memcpy(start, &field, sizeof(field));
+    }
+
+    struct envoy_header_t hdr = {
+        .agent   = -1,
+        .magic   = ENVOY_MAGIC,
+        .version = version,
+        .message = ENVOY_MSG_BATCH,
+        .length  = p - buf - sizeof(struct envoy_header_t)
+    };
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    return p - buf;
+}
+
+/* Returns the mask of agents the batch had records for */
+int envoy_decode_batch(struct agent_data_t *data, const char *payload, size_t len)
+{
+    const char *p = payload, *end = payload + len;
+    int mask = 0;
+
+    while ((size_t)(end - p) >= sizeof(struct envoy_field_t)) {
+        struct envoy_field_t field;
+        int32_t type;
+
+        memcpy(&field, p, sizeof(field));
+        p += sizeof(field);
+
+        if (field.length > end - p)
+            return -EBADMSG;
+
+        /* agents this side doesn't know about are skipped */
+        if (field.tag == ENVOY_FIELD_AGENT) {
+            if (field.length < sizeof(type))
+                return -EBADMSG;
+
+            memcpy(&type, p, sizeof(type));
+            if (type >= 0 && type < agent_count) {
+                data[type] = (struct agent_data_t){ .type = type, .status = ENVOY_STOPPED };
+
+                int rc = envoy_decode_agent(&data[type], p + sizeof(type),
+                                            field.length - sizeof(type));
+                if (rc < 0)
+                    return rc;
+                mask |= ENVOY_AGENT_BIT(type);
+            }
+        }
+
+        p += field.length;
+    }
+
+    return mask;
+}
+
+ssize_t envoy_encode_stats(char *buf, size_t size, const struct envoy_stats_t *stats, int version)
+{
+    char *p = buf + sizeof(struct envoy_header_t);
+    size_t i;
+
+    if (size < ENVOY_MAX_MESSAGE)
+        return -ENOSPC;
+
+    for (i = 0; i < ENVOY_COUNTER_MAX; ++i) {
+        struct envoy_counter_t counter = { .id = i, .value = stats->counters[i] };
+        p = put_field(p, ENVOY_FIELD_COUNTER, &counter, sizeof(counter));
+    }
+
+    for (i = 0; i < ENVOY_PHASE_MAX; ++i) {
+        struct envoy_timing_t timing = stats->timings[i];
+        timing.phase = i;
+        p = put_field(p, ENVOY_FIELD_TIMING, &timing, sizeof(timing));
+    }
+
+    for (i = 0; i < (size_t)agent_count; ++i) {
+        struct envoy_usage_t usage = stats->usage[i];
+        usage.agent = i;
+        p = put_field(p, ENVOY_FIELD_USAGE, &usage, sizeof(usage));
+    }
+
+    struct envoy_header_t hdr = {
+        .agent   = -1,
+        .magic   = ENVOY_MAGIC,
+        .version = version,
+        .message = ENVOY_MSG_STATS,
+        .length  = p - buf - sizeof(struct envoy_header_t)
+    };
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    return p - buf;
+}
+
+int envoy_decode_stats(struct envoy_stats_t *stats, const char *payload, size_t len)
+{
+    const char *p = payload, *end = payload + len;
+
+    *stats = (struct envoy_stats_t){ .counters = { 0 } };
+
+    while ((size_t)(end - p) >= sizeof(struct envoy_field_t)) {
+        struct envoy_field_t field;
+        struct envoy_counter_t counter;
+        struct envoy_timing_t timing;
+        struct envoy_usage_t usage;
+
+        memcpy(&field, p, sizeof(field));
+        p += sizeof(field);
+
+        if (field.length > end - p)
+            return -EBADMSG;
+
+        /* newer counters and phases are skipped like unknown fields */
+        switch (field.tag) {
+        case ENVOY_FIELD_COUNTER:
+            if (field.length != sizeof(counter))
+                return -EBADMSG;
+
+            memcpy(&counter, p, sizeof(counter));
+            if (counter.id < ENVOY_COUNTER_MAX)
+                stats->counters[counter.id] = counter.value;
+            break;
+        case ENVOY_FIELD_TIMING:
+            if (field.length != sizeof(timing))
+                return -EBADMSG;
+
+            memcpy(&timing, p, sizeof(timing));
+            if (timing.phase < ENVOY_PHASE_MAX)
+                stats->timings[timing.phase] = timing;
+            break;
+        case ENVOY_FIELD_USAGE:
+            if (field.length != sizeof(usage))
+                return -EBADMSG;
+
+            memcpy(&usage, p, sizeof(usage));
+            if (usage.agent >= 0 && usage.agent < AGENT_MAX)
+                stats->usage[usage.agent] = usage;
+            break;
+        default:
+            break;
+        }
+
+        p += field.length;
+    }
+
+    return 0;
+}
+
+/* Milliseconds to wait on envoyd, or -1 to wait forever */
+static int get_timeout(void)
+{
+    const char *timeout = getenv("ENVOY_TIMEOUT");
+    char *end;
+
+    if (!timeout || !*timeout)
+        return ENVOY_DEFAULT_TIMEOUT * 1000;
+
+    errno = 0;
+    long seconds = strtol(timeout, &end, 10);
+    if (errno || *end || seconds < 0 || seconds > INT_MAX / 1000)
+        return ENVOY_DEFAULT_TIMEOUT * 1000;
+
+    return seconds ? seconds * 1000 : -1;
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Wait for fd to become readable, giving up at the deadline (in the
+ * now_ms() clock, or -1 for none). */
+static int wait_readable(int fd, int64_t deadline)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    for (;;) {
+        int timeout = -1;
+
+        if (deadline >= 0) {
+            int64_t remaining = deadline - now_ms();
+            if (remaining <= 0)
+                return -ETIMEDOUT;
+            timeout = remaining;
+        }
+
+        int rc = poll(&pfd, 1, timeout);
+        if (rc > 0)
+            return 0;
+        else if (rc == 0)
+            return -ETIMEDOUT;
+        else if (errno != EINTR)
+            return -errno;
+    }
+}
+
+static int read_full(int fd, void *buf, size_t len, int64_t deadline)
+{
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t nbytes_r = read(fd, (char *)buf + total, len - total);
         if (nbytes_r < 0) {
-            if (errno != EAGAIN)
+            if (errno == EAGAIN) {
+                int rc = wait_readable(fd, deadline);
+                if (rc < 0)
+                    return rc;
+            } else if (errno != EINTR) {
                 return -errno;
+            }
+        } else if (nbytes_r == 0) {
+            break;
         } else {
-            return nbytes_r;
+            total += nbytes_r;
         }
     }
+
+    return total;
 }
 
-static int start_agent(int fd, struct agent_data_t *data, enum agent type)
+/* Read the rest of an agent reply, once its header is in */
+static int read_agent_reply(int fd, const struct envoy_header_t *hdr, struct agent_data_t *data,
+                            int *version, int64_t deadline)
 {
-    if (write(fd, &type, sizeof(enum agent)) < 0)
-        return -errno;
-    return read_agent(fd, data);
+    char payload[ENVOY_MAX_MESSAGE];
+    int nbytes_r;
+
+    if (hdr->magic != ENVOY_MAGIC) {
+        /* a legacy envoyd dumps its struct agent_data_t, minus home */
+        *version = ENVOY_PROTOCOL_LEGACY;
+        memcpy(data, hdr, sizeof(*hdr));
+
+        nbytes_r = read_full(fd, (char *)data + sizeof(*hdr), ENVOY_LEGACY_SIZE - sizeof(*hdr),
+                             deadline);
+        return nbytes_r < 0 ? nbytes_r : (int)sizeof(*hdr) + nbytes_r;
+    }
+
+    *version = hdr->version;
+    if (hdr->message != ENVOY_MSG_AGENT || hdr->length > sizeof(payload))
+        return -EBADMSG;
+
+    nbytes_r = read_full(fd, payload, hdr->length, deadline);
+    if (nbytes_r < 0)
+        return nbytes_r;
+    else if (nbytes_r < hdr->length)
+        return -EBADMSG;
+
+    *data = (struct agent_data_t){ .type = hdr->agent };
+    int rc = envoy_decode_agent(data, payload, hdr->length);
+    return rc < 0 ? rc : (int)sizeof(*hdr) + hdr->length;
 }
 
-int envoy_agent(struct agent_data_t *data, enum agent id, bool start)
+static int read_agent(int fd, struct agent_data_t *data, int *version, int64_t deadline)
+{
+    struct envoy_header_t hdr;
+
+    int nbytes_r = read_full(fd, &hdr, sizeof(hdr), deadline);
+    if (nbytes_r <= 0)
+        return nbytes_r;
+    else if (nbytes_r < (int)sizeof(hdr))
+        return -EBADMSG;
+
+    return read_agent_reply(fd, &hdr, data, version, deadline);
+}
+
+static struct envoy_shm_t *map_shm(void)
+{
+    struct envoy_shm_t *shm;
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), ENVOY_SHM_PATH, geteuid());
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    /* Only trust a file envoyd could have written: a root envoyd, or
+     * one running as this user. The directory is the user's own, so
+     * anything else may have been planted there. */
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+        (st.st_uid != 0 && st.st_uid != geteuid()) ||
+        (size_t)st.st_size < sizeof(*shm)) {
+        close(fd);
+        return NULL;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm == MAP_FAILED)
+        return NULL;
+
+    if (shm->magic != ENVOY_SHM_MAGIC || shm->version != ENVOY_SHM_VERSION ||
+        strncmp(shm->socket, get_socket_path(), sizeof(shm->socket)) != 0) {
+        munmap(shm, sizeof(*shm));
+        return NULL;
+    }
+
+    return shm;
+}
+
+static bool read_shm(const struct envoy_shm_t *shm, struct agent_data_t *data, enum agent id)
+{
+    struct envoy_shm_agent_t record;
+    uint32_t config = envoy_agents_config();
+    int tries;
+
+    for (tries = 0; tries < 100; ++tries) {
+        uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        enum agent type = id == AGENT_DEFAULT ? shm->default_agent : id;
+        if (type < 0 || type >= agent_count)
+            return false;
+
+        /* envoyd numbers defined agents by a file we might not share */
+        if (type >= LAST_AGENT && __atomic_load_n(&shm->config, __ATOMIC_RELAXED) != config)
+            return false;
+
+        memcpy(&record, &shm->agents[type], sizeof(record));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        if (record.status != ENVOY_RUNNING || record.pid <= 0)
+            return false;
+
+        /* the record is only as fresh as the envoyd watching the agent */
+        pid_t daemon = __atomic_load_n(&shm->daemon, __ATOMIC_RELAXED);
+        if (daemon <= 0 || (kill(daemon, 0) < 0 && errno == ESRCH))
+            return false;
+
+        *data = (struct agent_data_t){
+            .type   = type,
+            .status = ENVOY_RUNNING,
+            .pid    = record.pid
+        };
+        get_string(data->sock, sizeof(data->sock), record.sock,
+                   strnlen(record.sock, sizeof(record.sock)));
+        get_string(data->gpg, sizeof(data->gpg), record.gpg,
+                   strnlen(record.gpg, sizeof(record.gpg)));
+        get_string(data->home, sizeof(data->home), record.home,
+                   strnlen(record.home, sizeof(record.home)));
+        return true;
+    }
+
+    return false;
+}
+
+/* Look for a running agent in the file envoyd publishes. Returns false
+ * if there's no usable record, and the daemon should be asked. The file
+ * is mapped afresh every time: the euid may have changed since the last
+ * call, as it does in the PAM module, and envoyd may have replaced it. */
+static bool lookup_shm(struct agent_data_t *data, enum agent id)
+{
+    struct envoy_shm_t *shm = map_shm();
+    if (!shm)
+        return false;
+
+    bool found = read_shm(shm, data, id);
+    munmap(shm, sizeof(*shm));
+    return found;
+}
+
+/* Connect to envoyd and send it a request. Returns the socket. */
+static int send_buffer(const char *request, size_t len)
 {
     socklen_t sa_len;
     union {
@@ -103,27 +706,433 @@ int envoy_agent(struct agent_data_t *data, enum agent id, bool start)
         return -errno;
 
     sa_len = init_envoy_socket(&sa.un);
-    if (connect(fd, &sa.sa, sa_len) < 0)
+    if (connect(fd, &sa.sa, sa_len) < 0) {
+        close(fd);
         return -errno;
+    }
+
+    if (write(fd, request, len) < 0) {
+        close(fd);
+        return -errno;
+    }
 
-    int ret = read_agent(fd, data);
+    return fd;
+}
+
+static int send_request(enum agent id, enum envoy_message message)
+{
+    char request[ENVOY_MAX_REQUEST];
+    size_t len = envoy_encode_request(request, id, message);
+
+    return send_buffer(request, len);
+}
+
+/* A legacy envoyd answers before reading anything, then reads the
+ * agent type to start, which our request happens to lead with. It
+ * doesn't survive us hanging up early, so a prestart has to wait for
+ * the agent too. */
+static bool legacy_follow_up(const struct agent_data_t *data, int version,
+                             enum envoy_message message)
+{
+    return version == ENVOY_PROTOCOL_LEGACY && message != ENVOY_MSG_QUERY &&
+        data->status == ENVOY_STOPPED;
+}
+
+static int request_agent(struct agent_data_t *data, enum agent id, enum envoy_message message)
+{
+    int version;
+    int timeout = get_timeout();
+    int64_t deadline = timeout < 0 ? -1 : now_ms() + timeout;
 
-    if (ret && start && data->status == ENVOY_STOPPED)
-        ret = start_agent(fd, data, id);
+    if (lookup_shm(data, id))
+        return sizeof(*data);
+
+    int fd = send_request(id, message);
+    if (fd < 0)
+        return fd;
+
+    *data = (struct agent_data_t){ .status = ENVOY_STOPPED };
+    int ret = read_agent(fd, data, &version, deadline);
+    if (ret > 0 && legacy_follow_up(data, version, message))
+        ret = read_agent(fd, data, &version, deadline);
 
     close(fd);
     return ret;
 }
 
+int envoy_agent(struct agent_data_t *data, enum agent id, bool start)
+{
+    return request_agent(data, id, start ? ENVOY_MSG_START : ENVOY_MSG_QUERY);
+}
+
+int envoy_prestart(struct agent_data_t *data, enum agent id)
+{
+    return request_agent(data, id, ENVOY_MSG_PRESTART);
+}
+
+/* Read a batch reply. An envoyd that doesn't know about batches
+ * answers for the lowest agent in the request alone, and the rest is
+ * left to the caller. Returns the mask of agents read. */
+static int read_batch(int fd, struct agent_data_t *data, unsigned mask,
+                      enum envoy_message message, int64_t deadline)
+{
+    struct envoy_header_t hdr;
+    char payload[ENVOY_MAX_BATCH];
+    enum agent id = 0;
+    int version;
+
+    int nbytes_r = read_full(fd, &hdr, sizeof(hdr), deadline);
+    if (nbytes_r < 0)
+        return nbytes_r;
+    else if (nbytes_r < (int)sizeof(hdr))
+        return -EBADMSG;
+
+    /* payload has room for any length the header can hold */
+    if (hdr.magic == ENVOY_MAGIC && hdr.message == ENVOY_MSG_BATCH) {
+        nbytes_r = read_full(fd, payload, hdr.length, deadline);
+        if (nbytes_r < 0)
+            return nbytes_r;
+        else if (nbytes_r < hdr.length)
+            return -EBADMSG;
+
+        return envoy_decode_batch(data, payload, hdr.length);
+    }
+
+    while (!(mask & ENVOY_AGENT_BIT(id)))
+        ++id;
+
+    data[id] = (struct agent_data_t){ .status = ENVOY_STOPPED };
+    int ret = read_agent_reply(fd, &hdr, &data[id], &version, deadline);
+    if (ret > 0 && legacy_follow_up(&data[id], version, message))
+        ret = read_agent(fd, &data[id], &version, deadline);
+    if (ret <= 0)
+        return ret < 0 ? ret : -EBADMSG;
+
+    data[id].type = id;
+    return ENVOY_AGENT_BIT(id);
+}
+
+static int request_agents(struct agent_data_t *data, unsigned mask, enum envoy_message message)
+{
+    char request[ENVOY_MAX_REQUEST];
+    int timeout = get_timeout();
+    int64_t deadline = timeout < 0 ? -1 : now_ms() + timeout;
+    unsigned missing = 0;
+    enum agent id;
+    int fetched = 0;
+
+    mask &= ENVOY_ALL_AGENTS;
+    for (id = 0; id < agent_count; ++id) {
+        if (!(mask & ENVOY_AGENT_BIT(id)))
+            continue;
+
+        ++fetched;
+        if (!lookup_shm(&data[id], id))
+            missing |= ENVOY_AGENT_BIT(id);
+    }
+
+    if (!missing)
+        return fetched;
+
+    int fd = send_buffer(request, envoy_encode_batch_request(request, missing, message));
+    if (fd < 0)
+        return fd;
+
+    int ret = read_batch(fd, data, missing, message, deadline);
+    close(fd);
+    if (ret < 0)
+        return ret;
+
+    /* whatever an older envoyd didn't answer is asked for one by one */
+    missing &= ~(unsigned)ret;
+    for (id = 0; missing && id < agent_count; ++id) {
+        if (!(missing & ENVOY_AGENT_BIT(id)))
+            continue;
+
+        missing &= ~ENVOY_AGENT_BIT(id);
+        ret = request_agent(&data[id], id, message);
+        if (ret < 0)
+            return ret;
+        else if (ret == 0)
+            return -EBADMSG;
+        data[id].type = id;
+    }
+
+    return fetched;
+}
+
+int envoy_agents(struct agent_data_t *data, unsigned mask, bool start)
+{
+    return request_agents(data, mask, start ? ENVOY_MSG_START : ENVOY_MSG_QUERY);
+}
+
+int envoy_prestart_agents(struct agent_data_t *data, unsigned mask)
+{
+    return request_agents(data, mask, ENVOY_MSG_PRESTART);
+}
+
+int envoy_stats(struct envoy_stats_t *stats)
+{
+    struct envoy_header_t hdr;
+    char payload[ENVOY_MAX_MESSAGE];
+    int timeout = get_timeout();
+    int64_t deadline = timeout < 0 ? -1 : now_ms() + timeout;
+
+    int fd = send_request(AGENT_DEFAULT, ENVOY_MSG_STATS);
+    if (fd < 0)
+        return fd;
+
+    int ret = read_full(fd, &hdr, sizeof(hdr), deadline);
+    if (ret >= 0 && ret < (int)sizeof(hdr)) {
+        ret = -EBADMSG;
+    } else if (ret > 0) {
+        /* older daemons answer with an agent, or a legacy dump */
+        if (hdr.magic != ENVOY_MAGIC || hdr.message != ENVOY_MSG_STATS)
+            ret = -EPROTONOSUPPORT;
+        else if (hdr.length > sizeof(payload))
+            ret = -EBADMSG;
+        else if ((ret = read_full(fd, payload, hdr.length, deadline)) >= 0)
+            ret = ret < hdr.length ? -EBADMSG : envoy_decode_stats(stats, payload, hdr.length);
+    }
+
+    close(fd);
+    return ret;
+}
+
+int envoy_watch(enum agent id)
+{
+    return send_request(id, ENVOY_MSG_WATCH);
+}
+
+int envoy_watch_next(int fd, struct agent_data_t *data)
+{
+    int version;
+
+    *data = (struct agent_data_t){ .status = ENVOY_STOPPED };
+    return read_agent(fd, data, &version, -1);
+}
+
+/* FNV-1a over a name and its terminating NUL */
+static uint32_t hash_name(uint32_t hash, const char *name)
+{
+    const unsigned char *p = (const unsigned char *)name;
+
+    do {
+        hash ^= *p;
+        hash *= 16777619u;
+    } while (*p++);
+
+    return hash;
+}
+
+#define FNV_OFFSET_BASIS 2166136261u
+
+/* Worked out as the agents are defined, the names don't change after */
+static uint32_t name_hash[AGENT_MAX];
+static uint32_t agents_config = FNV_OFFSET_BASIS;
+
+/* The built-in agents are the same everywhere, so they're left out */
+uint32_t envoy_agents_config(void)
+{
+    return agents_config;
+}
+
+static void intern_builtin_agents(void)
+{
+    static bool interned = false;
+    int i;
+
+    if (interned)
+        return;
+
+    for (i = 0; i < LAST_AGENT; ++i)
+        name_hash[i] = hash_name(FNV_OFFSET_BASIS, builtin_agents[i].name);
+    interned = true;
+}
+
 enum agent lookup_agent(const char *string)
 {
-    size_t i;
+    uint32_t hash = hash_name(FNV_OFFSET_BASIS, string);
+    int i;
 
-    for (i = 0; i < LAST_AGENT; i++)
-        if (strcmp(Agent[i].name, string) == 0)
-            break;
+    intern_builtin_agents();
+    for (i = 0; i < agent_count; i++)
+        if (name_hash[i] == hash && strcmp(Agent[i]->name, string) == 0)
+            return i;
+
+    return AGENT_MAX;
+}
+
+#define AGENT_NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-"
+
+/* Split a value on whitespace into a NULL terminated array */
+static char **split_words(const char *value)
+{
+    size_t count = 0;
+    char **words = NULL, *copy, *word, *save;
+
+    copy = strdup(value);
+    if (!copy)
+        err(EXIT_FAILURE, "failed to allocate memory");
+
+    for (word = strtok_r(copy, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+        words = realloc(words, (count + 2) * sizeof(char *));
+        if (!words)
+            err(EXIT_FAILURE, "failed to allocate memory");
+        words[count++] = word;
+    }
+
+    if (!count) {
+        free(copy);
+        return NULL;
+    }
+
+    words[count] = NULL;
+    return words;
+}
+
+static char *copy_string(const char *value)
+{
+    char *copy = strdup(value);
+    if (!copy)
+        err(EXIT_FAILURE, "failed to allocate memory");
+    return copy;
+}
+
+static bool set_agent_key(struct agent_t *agent, const char *key, const char *value)
+{
+    if (strcmp(key, "exec") == 0) {
+        char **argv = split_words(value);
+
+        /* agents are exec'd without a PATH search */
+        if (!argv || argv[0][0] != '/')
+            return false;
+        agent->argv = argv;
+    } else if (strcmp(key, "environ") == 0) {
+        agent->environ = split_words(value);
+    } else if (strcmp(key, "socket") == 0) {
+        agent->sock_env = copy_string(value);
+    } else if (strcmp(key, "pid") == 0) {
+        agent->pid_env = copy_string(value);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static char *strip(char *s)
+{
+    char *end = s + strlen(s);
+
+    while (*s == ' ' || *s == '\t')
+        ++s;
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n'))
+        *--end = '\0';
+    return s;
+}
+
+/* An agent is added once its section ends, if it has something to run */
+static void finish_agent(const char *path, struct agent_t *agent, int lineno)
+{
+    if (!agent->name)
+        return;
+
+    if (agent->argv) {
+        struct agent_t *slot = &defined_agents[agent_count - LAST_AGENT];
+
+        *slot = *agent;
+        name_hash[agent_count] = hash_name(FNV_OFFSET_BASIS, slot->name);
+        agents_config = hash_name(agents_config, slot->name);
+        agent_table[agent_count++] = slot;
+    } else {
+        warnx("%s:%d: agent has no exec line, ignoring", path, lineno);
+    }
+    *agent = (struct agent_t){ .name = NULL };
+}
+
+/* The warnings only point at line numbers, the file's contents aren't
+ * necessarily the caller's to read */
+int load_agents(const char *path)
+{
+    static int loaded = -1;
+    struct agent_t agent = { .name = NULL };
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0, section = 0, first = agent_count;
+    bool skip = false;
+
+    /* the PAM module asks once every session */
+    if (loaded >= 0)
+        return loaded;
+    if (!path)
+        path = getenv("ENVOY_AGENTS");
+    if (!path)
+        path = ENVOY_AGENTS_PATH;
+
+    intern_builtin_agents();
+
+    FILE *fp = fopen(path, "re");
+    if (!fp)
+        return errno == ENOENT ? (loaded = 0) : -errno;
+
+    while (getline(&line, &size, fp) > 0) {
+        char *p = strip(line), *eq;
+        ++lineno;
+
+        if (!*p || *p == '#')
+            continue;
+
+        if (*p == '[') {
+            char *end = strchr(p, ']');
+
+            finish_agent(path, &agent, section);
+            section = lineno;
+            skip = true;
+
+            if (!end || end[1] || end == p + 1) {
+                warnx("%s:%d: malformed section", path, lineno);
+                continue;
+            }
+
+            /* the name ends up in unit names, keep it to what they allow */
+            *end = '\0';
+            if (strspn(p + 1, AGENT_NAME_CHARS) != strlen(p + 1)) {
+                warnx("%s:%d: invalid agent name", path, lineno);
+                continue;
+            } else if (lookup_agent(p + 1) != AGENT_MAX) {
+                warnx("%s:%d: agent is already defined", path, lineno);
+                continue;
+            } else if (agent_count == AGENT_MAX) {
+                warnx("%s:%d: too many agents, ignoring", path, lineno);
+                continue;
+            }
+
+            agent.name = copy_string(p + 1);
+            skip = false;
+            continue;
+        }
+
+        eq = strchr(p, '=');
+        if (!eq) {
+            warnx("%s:%d: expected key = value", path, lineno);
+            continue;
+        } else if (skip) {
+            continue;
+        } else if (!agent.name) {
+            warnx("%s:%d: key outside of an agent section", path, lineno);
+            continue;
+        }
+
+        *eq = '\0';
+        if (!set_agent_key(&agent, strip(p), strip(eq + 1)))
+            warnx("%s:%d: bad value or unknown key", path, lineno);
+    }
 
-    return i;
+    finish_agent(path, &agent, section);
+    free(line);
+    fclose(fp);
+    return loaded = agent_count - first;
 }
 
 void safe_asprintf(char **strp, const char *fmt, ...)
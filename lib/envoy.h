@@ -19,16 +19,24 @@
 #define LIBENVOY_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
+/* The built-in agents end at LAST_AGENT. Agents defined in
+ * ENVOY_AGENTS_PATH are numbered from there on, in the order the file
+ * lists them. AGENT_MAX sizes every table indexed by agent type,
+ * including the shared agents file, so it's kept well short of the 32
+ * a request's bitmask could name. */
 enum agent {
     AGENT_DEFAULT = -1,
     AGENT_SSH_AGENT = 0,
     AGENT_GPG_AGENT,
-    LAST_AGENT
+    LAST_AGENT,
+    AGENT_MAX = 16
 };
 
 enum status {
@@ -37,13 +45,26 @@ enum status {
     ENVOY_RUNNING,
     ENVOY_FAILED,
     ENVOY_BADUSER,
+    ENVOY_BADCONFIG,
 };
 
+/* environ names variables passed on from envoyd's own environment.
+ * sock_env and pid_env are the variables the agent prints its socket
+ * and pid in, SSH_AUTH_SOCK and SSH_AGENT_PID when NULL. An empty
+ * pid_env means the agent doesn't print its pid at all. */
 struct agent_t {
     const char *name;
     char *const *argv;
+    char *const *environ;
+    const char *sock_env;
+    const char *pid_env;
 };
 
+#define ENVOY_AGENTS_PATH "/etc/envoy/agents.conf"
+
+/* The legacy protocol dumps this struct as is, up to home. home is the
+ * user's home directory as envoyd resolved it, so clients don't need to
+ * look it up themselves. It's empty if envoyd didn't send it. */
 struct agent_data_t {
     enum agent type;
     enum status status;
@@ -51,14 +72,239 @@ struct agent_data_t {
     char sock[PATH_MAX];
     char gpg[PATH_MAX];
     char unit_path[PATH_MAX];
+    char home[PATH_MAX];
+};
+
+#define ENVOY_LEGACY_SIZE offsetof(struct agent_data_t, home)
+
+#define ENVOY_MAGIC            0x59564e45u /* "ENVY" */
+#define ENVOY_PROTOCOL_LEGACY  1
+#define ENVOY_PROTOCOL_VERSION 2
+
+enum envoy_message {
+    ENVOY_MSG_QUERY = 1,
+    ENVOY_MSG_START,
+    ENVOY_MSG_AGENT,
+    ENVOY_MSG_PRESTART,
+    ENVOY_MSG_STATS,
+    ENVOY_MSG_WATCH,
+    ENVOY_MSG_BATCH,
+};
+
+enum envoy_field {
+    ENVOY_FIELD_STATUS = 1,
+    ENVOY_FIELD_PID,
+    ENVOY_FIELD_SOCK,
+    ENVOY_FIELD_GPG,
+    ENVOY_FIELD_COUNTER,
+    ENVOY_FIELD_TIMING,
+    ENVOY_FIELD_HOME,
+    ENVOY_FIELD_AGENTS,
+    ENVOY_FIELD_AGENT,
+    ENVOY_FIELD_USAGE,
+    ENVOY_FIELD_CONFIG,
+};
+
+/* Every message starts with the agent type, just like the legacy
+ * struct agent_data_t dump did, but follows it with a magic where the
+ * legacy dump has its status. That's how both sides tell the protocols
+ * apart. The header is followed by length bytes of fields, each a
+ * struct envoy_field_t and its value. Unknown fields are skipped. */
+struct envoy_header_t {
+    int32_t agent;
+    uint32_t magic;
+    uint8_t version;
+    uint8_t message;
+    uint16_t length;
+};
+
+struct envoy_field_t {
+    uint16_t tag;
+    uint16_t length;
+};
+
+#define ENVOY_MAX_MESSAGE (sizeof(struct envoy_header_t) + 5 * sizeof(struct envoy_field_t) + \
+                           2 * sizeof(uint32_t) + 3 * PATH_MAX)
+
+/* Every request carries ENVOY_FIELD_CONFIG, the uint32_t hash
+ * envoy_agents_config() returns. The agents a client defined are only
+ * numbered the same as envoyd's if it read the same names in the same
+ * order, and envoyd answers requests for them with ENVOY_BADCONFIG
+ * when the hashes differ. */
+#define ENVOY_MAX_REQUEST (sizeof(struct envoy_header_t) + 2 * sizeof(struct envoy_field_t) + \
+                           2 * sizeof(uint32_t))
+
+/* A query, start or prestart carrying ENVOY_FIELD_AGENTS, a uint32_t
+ * bitmask of agent types, asks about all of them at once. Its header
+ * names the lowest of them, which is all an older envoyd answers for.
+ * The reply is an ENVOY_MSG_BATCH holding an ENVOY_FIELD_AGENT for each
+ * type: the int32_t type followed by that agent's fields. A batch is as
+ * long as its records, and any that don't fit its header's length are
+ * left out, for the client to ask about one at a time. */
+#define ENVOY_AGENT_BIT(id) (1u << (id))
+#define ENVOY_ALL_AGENTS    (ENVOY_AGENT_BIT(agent_count) - 1)
+
+#define ENVOY_MAX_BATCH (sizeof(struct envoy_header_t) + UINT16_MAX)
+
+enum envoy_counter {
+    ENVOY_COUNTER_REQUESTS,
+    ENVOY_COUNTER_STARTS,
+    ENVOY_COUNTER_RESTARTS,
+    ENVOY_COUNTER_REJECTIONS,
+    ENVOY_COUNTER_FAILURES,
+    ENVOY_COUNTER_REAPED,
+    ENVOY_COUNTER_MAX
+};
+
+/* Where envoyd spends its time. ENVOY_PHASE_SPAWN covers a whole
+ * agent start, from fork until the agent's output is parsed. */
+enum envoy_phase {
+    ENVOY_PHASE_ACCEPT,
+    ENVOY_PHASE_CREDENTIALS,
+    ENVOY_PHASE_LOOKUP,
+    ENVOY_PHASE_FORK,
+    ENVOY_PHASE_SCOPE,
+    ENVOY_PHASE_PARSE,
+    ENVOY_PHASE_REPLY,
+    ENVOY_PHASE_SPAWN,
+    ENVOY_PHASE_MAX
+};
+
+/* The values of ENVOY_FIELD_COUNTER and ENVOY_FIELD_TIMING. Times are
+ * in nanoseconds. */
+struct envoy_counter_t {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t value;
 };
 
-extern const struct agent_t Agent[LAST_AGENT];
+struct envoy_timing_t {
+    uint32_t phase;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+};
+
+/* The value of ENVOY_FIELD_USAGE, what the scopes of one agent type
+ * are using between them. Memory is in bytes, CPU time in microseconds. */
+struct envoy_usage_t {
+    int32_t agent;
+    uint32_t scopes;
+    uint64_t memory;
+    uint64_t memory_max;
+    uint64_t cpu;
+};
 
+struct envoy_stats_t {
+    uint64_t counters[ENVOY_COUNTER_MAX];
+    struct envoy_timing_t timings[ENVOY_PHASE_MAX];
+    struct envoy_usage_t usage[AGENT_MAX];
+};
+
+extern const char *const envoy_counter_names[ENVOY_COUNTER_MAX];
+extern const char *const envoy_phase_names[ENVOY_PHASE_MAX];
+
+/* envoyd publishes each user's agents in this file, so clients can
+ * skip the round trip to the daemon while an agent is running. */
+#define ENVOY_SHM_PATH    "/run/user/%u/envoy-agents"
+#define ENVOY_SHM_MAGIC   0x4d534e45u /* "ENSM" */
+#define ENVOY_SHM_VERSION 4
+
+struct envoy_shm_agent_t {
+    uint32_t status;
+    int32_t pid;
+    char sock[PATH_MAX];
+    char gpg[PATH_MAX];
+    char home[PATH_MAX];
+};
+
+/* seq is a seqlock: it's odd while envoyd is updating the file, and
+ * readers retry if it changed while they were copying. daemon is the
+ * pid of the envoyd that wrote it, the records are stale without it.
+ * config is envoyd's envoy_agents_config(), the records of defined
+ * agents mean nothing to a reader that doesn't share it. */
+struct envoy_shm_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    int32_t daemon;
+    int32_t default_agent;
+    uint32_t config;
+    char socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct envoy_shm_agent_t agents[AGENT_MAX];
+};
+
+/* Indexed by agent type, up to agent_count */
+extern const struct agent_t *const *const Agent;
+extern int agent_count;
+
+const char *get_socket_path(void);
 size_t init_envoy_socket(struct sockaddr_un *un);
 void unlink_envoy_socket(void);
 
+/* Seconds to wait for envoyd's answer unless ENVOY_TIMEOUT says
+ * otherwise. ENVOY_TIMEOUT=0 waits forever. */
+#define ENVOY_DEFAULT_TIMEOUT 30
+
+/* Returns -ETIMEDOUT if envoyd didn't answer in time */
 int envoy_agent(struct agent_data_t *data, enum agent id, bool start);
+
+/* Like starting the agent, but envoyd answers right away with
+ * ENVOY_STARTED and no agent details if it has to start one, so the
+ * caller doesn't wait on it. Only envoyd's --prestart agents do this,
+ * others are treated as a query. */
+int envoy_prestart(struct agent_data_t *data, enum agent id);
+
+/* Fetch every agent in mask in one exchange, starting the missing ones
+ * side by side. data is indexed by agent type, entries outside mask are
+ * left alone. Returns the number of agents fetched. */
+int envoy_agents(struct agent_data_t *data, unsigned mask, bool start);
+int envoy_prestart_agents(struct agent_data_t *data, unsigned mask);
+
+/* Returns -EPROTONOSUPPORT if envoyd is too old to keep stats */
+int envoy_stats(struct envoy_stats_t *stats);
+
+/* Subscribe to an agent's state. Returns a socket to pass to
+ * envoy_watch_next(), which blocks until the next update and returns 0
+ * once envoyd hangs up. The first update is the current state. */
+int envoy_watch(enum agent id);
+int envoy_watch_next(int fd, struct agent_data_t *data);
+size_t envoy_encode_request(char *buf, enum agent id, enum envoy_message message);
+size_t envoy_encode_batch_request(char *buf, unsigned mask, enum envoy_message message);
+
+/* What a request carries besides its header */
+struct envoy_request_t {
+    unsigned agents;
+    bool has_config;
+    uint32_t config;
+};
+
+void envoy_decode_request(struct envoy_request_t *req, const char *payload, size_t len);
+
+ssize_t envoy_encode_agent(char *buf, size_t size, const struct agent_data_t *data, int version);
+int envoy_decode_agent(struct agent_data_t *data, const char *payload, size_t len);
+ssize_t envoy_encode_batch(char *buf, size_t size, const struct agent_data_t *data, unsigned mask,
+                           int version);
+int envoy_decode_batch(struct agent_data_t *data, const char *payload, size_t len);
+ssize_t envoy_encode_stats(char *buf, size_t size, const struct envoy_stats_t *stats, int version);
+int envoy_decode_stats(struct envoy_stats_t *stats, const char *payload, size_t len);
+
+/* Read the agent definitions in path. When it's NULL, that's
+ * ENVOY_AGENTS, or ENVOY_AGENTS_PATH if that's unset. Everyone talking
+ * to the same envoyd has to read the same file so they agree on the
+ * ids, envoy_agents_config() is how envoyd tells when they didn't. A
+ * missing file defines nothing. Returns the number of agents defined,
+ * or -errno. */
+int load_agents(const char *path);
+
+/* A hash of the names of the agents load_agents() defined, in order */
+uint32_t envoy_agents_config(void);
+
+/* Returns AGENT_MAX for unknown agents */
 enum agent lookup_agent(const char *string);
 void safe_asprintf(char **strp, const char *fmt, ...) __attribute__((format (printf, 2, 3)));
 
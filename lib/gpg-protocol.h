@@ -18,21 +18,43 @@
 #ifndef GPG_PROTOCOL_H
 #define GPG_PROTOCOL_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
 struct gpg_t;
 
-struct fingerprint_t {
-    char *fingerprint;
-    struct fingerprint_t *next;
+enum {
+    KEY_DISABLED   = 1 << 0,
+    KEY_SSHCONTROL = 1 << 1,
+    KEY_CONFIRM    = 1 << 2
+};
+
+/* One entry of gpg-agent's KEYINFO listing. The keygrip is exactly 40
+ * hex digits and isn't NUL terminated. */
+struct keyinfo_t {
+    char keygrip[40];
+    char type;
+    char protection;
+    bool cached;
+    int ttl;
+    unsigned flags;
 };
 
 struct gpg_t *gpg_agent_connection(const char *sock);
+
+/* Like gpg_agent_connection(), but NULL unless the agent on the other
+ * end runs as uid */
+struct gpg_t *gpg_agent_connection_owned(const char *sock, uid_t uid);
 void gpg_close(struct gpg_t *gpg);
 
-int gpg_update_tty(struct gpg_t *gpg);
-int gpg_preset_passphrase(struct gpg_t *gpg, const char *fingerprint, int timeout, const char *password);
-struct fingerprint_t *gpg_keyinfo(struct gpg_t *gpg);
+int gpg_queue(struct gpg_t *gpg, const char *fmt, ...) __attribute__((format (printf, 2, 3)));
+int gpg_flush(struct gpg_t *gpg, int *results);
 
-void free_fingerprints(struct fingerprint_t *frpt);
+int gpg_update_tty(struct gpg_t *gpg, const char *home);
+int gpg_preset_passphrase(struct gpg_t *gpg, const char *fingerprint, int timeout, const char *password);
+int gpg_preset_passphrase_all(struct gpg_t *gpg, int timeout, const char *password);
+const struct keyinfo_t *gpg_keyinfo(struct gpg_t *gpg, size_t *count);
 
 #endif
 
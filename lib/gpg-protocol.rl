@@ -31,9 +31,26 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+/* Big enough for a KEYINFO listing of a few hundred keys to arrive in
+ * one read */
+#define GPG_BUFFER_SIZE 65536
+
 struct gpg_t {
     int fd;
-    char buf[BUFSIZ];
+
+    /* always NUL terminated at pe, for error messages */
+    char buf[GPG_BUFFER_SIZE + 1];
+
+    /* commands queued for the next flush */
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    size_t queued;
+
+    /* results of the last KEYINFO */
+    struct keyinfo_t *keys;
+    size_t nkeys;
+    size_t keys_size;
 
     /* ragel parser state */
     int cs;
@@ -43,7 +60,12 @@ struct gpg_t {
 
 static int gpg_buffer_refill(struct gpg_t *gpg)
 {
-    ssize_t nbytes_r = read(gpg->fd, gpg->buf, BUFSIZ);
+    ssize_t nbytes_r;
+
+    do {
+        nbytes_r = read(gpg->fd, gpg->buf, GPG_BUFFER_SIZE);
+    } while (nbytes_r < 0 && errno == EINTR);
+
     if (nbytes_r < 0)
         return -errno;
 
@@ -57,20 +79,43 @@ static int gpg_buffer_refill(struct gpg_t *gpg)
     machine status;
 
     action error {
-        fprintf(stderr, "%s: gpg protocol error: %s", program_invocation_short_name, fpc);
+        fprintf(stderr, "%s: gpg protocol error: %.*s\n", program_invocation_short_name,
+                (int)strcspn(fpc, "\n"), fpc);
         rc = -EIO;
     }
-    action return { return rc; }
+    action reply {
+        if (results)
+            results[nreplies] = rc;
+        if (rc < 0)
+            ++failed;
+
+        rc = 0;
+        if (++nreplies == expected)
+            fbreak;
+    }
 
     newline = '\n';
-    main := ( 'OK' | 'ERR' >error ) [^\n]* newline %return;
+    reply = ( 'OK' | 'ERR' >error ) [^\n]* newline @reply;
+
+    # status lines and comments may precede a reply, skip them
+    info = ( 'S ' | '#' ) [^\n]* newline;
+
+    main := ( info | reply )*;
 }%%
 
 %%write data;
 
-static int gpg_check_return(struct gpg_t *gpg)
+/* Read the next expected OK/ERR replies. If results is provided, it is
+ * filled with 0 or -EIO for every reply in order. Returns the number of
+ * commands that failed, or a negative errno if the replies couldn't be
+ * read. */
+static int gpg_read_replies(struct gpg_t *gpg, size_t expected, int *results)
 {
-    int rc = 0;
+    size_t nreplies = 0;
+    int rc = 0, failed = 0;
+
+    if (expected == 0)
+        return 0;
 
     %%access gpg->;
     %%variable p gpg->p;
@@ -80,35 +125,100 @@ static int gpg_check_return(struct gpg_t *gpg)
     for (;;) {
         if (gpg->p == NULL || gpg->p == gpg->pe) {
             if (gpg_buffer_refill(gpg) <= 0)
-                break;
+                return -EIO;
         }
 
-        char *eof = gpg->pe;
         %%write exec;
 
         if (gpg->cs == status_error) {
             warnx("error parsing gpg protocol");
-            break;
+            return -EIO;
         }
+
+        if (nreplies == expected)
+            return failed;
     }
+}
 
-    return rc;
+static int gpg_check_return(struct gpg_t *gpg)
+{
+    int rc = gpg_read_replies(gpg, 1, NULL);
+    return rc > 0 ? -EIO : rc;
 }
 
-static int __attribute__((format (printf, 2, 3))) gpg_send_message(struct gpg_t *gpg, const char *fmt, ...)
+int gpg_queue(struct gpg_t *gpg, const char *fmt, ...)
 {
     va_list ap;
-    int nbytes_r, rc;
+    int len;
 
     va_start(ap, fmt);
-    nbytes_r = vdprintf(gpg->fd, fmt, ap);
+    len = vsnprintf(NULL, 0, fmt, ap);
     va_end(ap);
 
-    rc = gpg_check_return(gpg);
-    return rc == 0 ? nbytes_r : rc;
+    if (len < 0)
+        return -errno;
+
+    /* not realloc: the old buffer may hold queued passphrases, and
+     * has to be wiped before it's given back */
+    if (gpg->out_len + len + 1 > gpg->out_size) {
+        size_t size = 2 * (gpg->out_len + len + 1);
+        char *out = malloc(size);
+        if (!out)
+            return -ENOMEM;
+
+        if (gpg->out) {
+            memcpy(out, gpg->out, gpg->out_len);
+            explicit_bzero(gpg->out, gpg->out_size);
+            free(gpg->out);
+        }
+
+        gpg->out = out;
+        gpg->out_size = size;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(&gpg->out[gpg->out_len], len + 1, fmt, ap);
+    va_end(ap);
+
+    gpg->out_len += len;
+    return ++gpg->queued;
 }
 
-struct gpg_t *gpg_agent_connection(const char *sock)
+/* Drop everything queued, wiping any passphrases with it */
+static void gpg_discard(struct gpg_t *gpg)
+{
+    if (gpg->out)
+        explicit_bzero(gpg->out, gpg->out_len);
+    gpg->out_len = gpg->queued = 0;
+}
+
+/* Send everything queued with gpg_queue() in a single write, then read
+ * back all the replies. Returns the number of commands that failed, or
+ * a negative errno. results, if not NULL, must have room for every
+ * queued command and gets each command's status. */
+int gpg_flush(struct gpg_t *gpg, int *results)
+{
+    size_t written = 0, queued = gpg->queued;
+
+    while (written < gpg->out_len) {
+        ssize_t nbytes_w = write(gpg->fd, &gpg->out[written], gpg->out_len - written);
+        if (nbytes_w < 0) {
+            if (errno == EINTR)
+                continue;
+
+            int saved = errno;
+            gpg_discard(gpg);
+            return -saved;
+        }
+        written += nbytes_w;
+    }
+
+    /* presets leave passphrases in here */
+    gpg_discard(gpg);
+    return gpg_read_replies(gpg, queued, results);
+}
+
+static struct gpg_t *connect_agent(const char *sock, bool check, uid_t uid)
 {
     char *split;
     union {
@@ -124,20 +234,42 @@ struct gpg_t *gpg_agent_connection(const char *sock)
         return NULL;
     }
 
+    /* GPG_AGENT_INFO is path:pid:protocol, but take a bare path too */
     split = strchr(sock, ':');
-    len = split - sock;
+    len = split ? (size_t)(split - sock) : strlen(sock);
 
     sa.un = (struct sockaddr_un){ .sun_family = AF_UNIX };
+    if (len >= sizeof(sa.un.sun_path)) {
+        warnx("gpg-agent socket path is too long");
+        close(fd);
+        return NULL;
+    }
     memcpy(&sa.un.sun_path, sock, len);
 
     sa_len = len + sizeof(sa.un.sun_family);
     if (connect(fd, &sa.sa, sa_len) < 0) {
         warn("failed to connect to gpg-agent");
+        close(fd);
         return NULL;
     }
 
-    struct gpg_t *gpg = malloc(sizeof(struct gpg_t));
-    *gpg = (struct gpg_t) { .fd = fd };
+    if (check) {
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != uid) {
+            warnx("gpg-agent isn't running as uid=%u", uid);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    struct gpg_t *gpg = calloc(1, sizeof(struct gpg_t));
+    if (!gpg) {
+        close(fd);
+        return NULL;
+    }
+    gpg->fd = fd;
 
     if (gpg_check_return(gpg) < 0) {
         warnx("incorrect response from gpg-agent");
@@ -148,11 +280,24 @@ struct gpg_t *gpg_agent_connection(const char *sock)
     return gpg;
 }
 
-int gpg_update_tty(struct gpg_t *gpg)
+struct gpg_t *gpg_agent_connection(const char *sock)
+{
+    return connect_agent(sock, false, 0);
+}
+
+struct gpg_t *gpg_agent_connection_owned(const char *sock, uid_t uid)
+{
+    return connect_agent(sock, true, uid);
+}
+
+/* home is the user's home directory, if the caller already knows it */
+int gpg_update_tty(struct gpg_t *gpg, const char *home)
 {
     extern char **environ;
     char *display = NULL, *term = NULL, *tty = ttyname(STDIN_FILENO);
-    int i;
+    const char *commands[6];
+    int i, results[6], rc;
+    size_t n = 0;
 
     for (i = 0; environ[i]; ++i) {
         if (strncmp(environ[i], "DISPLAY=", 8) == 0)
@@ -161,46 +306,93 @@ int gpg_update_tty(struct gpg_t *gpg)
             term = environ[i] + 5;
     }
 
-    gpg_send_message(gpg, "RESET\n");
+    /* commands[] has to match what was queued, so stop at the first
+     * command that couldn't be */
+    rc = gpg_queue(gpg, "RESET\n");
+    commands[n++] = "RESET";
+
+    if (rc >= 0 && tty) {
+        rc = gpg_queue(gpg, "OPTION ttyname=%s\n", tty);
+        commands[n++] = "OPTION ttyname";
+    }
+
+    if (rc >= 0 && term) {
+        rc = gpg_queue(gpg, "OPTION ttytype=%s\n", term);
+        commands[n++] = "OPTION ttytype";
+    }
+
+    if (rc >= 0 && display) {
+        if (!home || !home[0]) {
+            struct passwd *pwd = getpwuid(getuid());
+            if (pwd == NULL || pwd->pw_dir == NULL)
+                err(EXIT_FAILURE, "failed to lookup passwd entry");
+            home = pwd->pw_dir;
+        }
+
+        rc = gpg_queue(gpg, "OPTION display=%s\n", display);
+        commands[n++] = "OPTION display";
+        if (rc >= 0) {
+            rc = gpg_queue(gpg, "OPTION xauthority=%s/.Xauthority\n", home);
+            commands[n++] = "OPTION xauthority";
+        }
+    }
 
-    if (tty)
-        gpg_send_message(gpg, "OPTION ttyname=%s\n", tty);
+    if (rc >= 0) {
+        rc = gpg_queue(gpg, "UPDATESTARTUPTTY\n");
+        commands[n++] = "UPDATESTARTUPTTY";
+    }
 
-    if (term)
-        gpg_send_message(gpg, "OPTION ttytype=%s\n", term);
+    if (rc < 0) {
+        gpg_discard(gpg);
+        return rc;
+    }
 
-    if (display) {
-        struct passwd *pwd = getpwuid(getuid());
-        if (pwd == NULL || pwd->pw_dir == NULL)
-            err(EXIT_FAILURE, "failed to lookup passwd entry");
+    rc = gpg_flush(gpg, results);
+    if (rc < 0)
+        return rc;
 
-        gpg_send_message(gpg, "OPTION display=%s\n", display);
-        gpg_send_message(gpg, "OPTION xauthority=%s/.Xauthority\n", pwd->pw_dir);
+    for (i = 0; rc && i < (int)n; ++i) {
+        if (results[i] < 0)
+            warnx("gpg-agent failed to handle %s", commands[i]);
     }
 
-    gpg_send_message(gpg, "UPDATESTARTUPTTY\n");
-    return 0;
+    return rc ? -EIO : 0;
 }
 
 %%{
     machine keyinfo;
 
-    action clear { keylen = 0; }
-    action append { keygrip[keylen++] = fc; }
-    action term {
-        struct fingerprint_t *next = fpt;
-        fpt = malloc(sizeof(struct fingerprint_t));
-        *fpt = (struct fingerprint_t){
-            .fingerprint = strndup(keygrip, keylen),
-            .next = next
-        };
+    action clear {
+        key = (struct keyinfo_t){ .ttl = -1 };
+        keylen = 0;
     }
+    action append { key.keygrip[keylen++] = fc; }
+    action type { key.type = fc; }
+    action cached { key.cached = true; }
+    action protection { key.protection = fc; }
+    action ttl_clear { key.ttl = 0; }
+    action ttl_digit { key.ttl = 10 * key.ttl + (fc - '0'); }
+    action flag {
+        switch (fc) {
+        case 'D': key.flags |= KEY_DISABLED; break;
+        case 'S': key.flags |= KEY_SSHCONTROL; break;
+        case 'c': key.flags |= KEY_CONFIRM; break;
+        }
+    }
+    action term { fn(&key, arg); }
 
-    action error { fprintf(stderr, "%s: gpg protocol error: %s", program_invocation_short_name, fpc); }
-    action return { return fpt; }
+    action error {
+        fprintf(stderr, "%s: gpg protocol error: %.*s\n", program_invocation_short_name,
+                (int)strcspn(fpc, "\n"), fpc);
+        rc = -EIO;
+    }
+    action done {
+        done = true;
+        fbreak;
+    }
 
     newline = '\n';
-    status = ( 'OK' | 'ERR' >error [^\n]* ) newline %return;
+    status = ( 'OK' | 'ERR' >error ) [^\n]* newline @done;
 
     # KEYGRIP is the keygrip
     keygrip = xdigit{40} >clear $append;
@@ -210,51 +402,64 @@ int gpg_update_tty(struct gpg_t *gpg)
     #     'T' - Key is stored on a smartcard (token),
     #     'X' - Unknown type,
     #     '-' - Key is missing.
-    type = [DTX\-];
+    type = [DTX\-] @type;
 
     # SERIALNO is an ASCII string with the serial number of the
     #          smartcard.  If the serial number is not known a single
     #          dash '-' is used instead.
-    serialno = alpha+ | '-';
+    serialno = alnum+ | '-';
 
     # IDSTR is the IDSTR used to distinguish keys on a smartcard.  If it
     #       is not known a dash is used instead.
-    idstr = [^\ ]+ | '-';
+    idstr = [^ \n]+;
+
+    # CACHED is 1 if the passphrase for the key was found in the key
+    #        cache.  If not, a '-' is used instead.
+    cached = '1' @cached | '-';
+
+    # PROTECTION describes the key protection type:
+    #     'P' - The key is protected with a passphrase,
+    #     'C' - The key is not protected,
+    #     '-' - Unknown protection.
+    protection = [PC\-] @protection;
 
     # FPR returns the formatted ssh-style fingerprint of the key.  It is only
     #     printed if the option --ssh-fpr has been used.  It defaults to '-'.
-    fpr = '-';
+    fpr = [^ \n]+;
 
     # TTL is the TTL in seconds for that key or '-' if n/a.
-    ttl = digit+ | '-';
+    ttl = digit+ >ttl_clear $ttl_digit | '-';
 
     # FLAGS is a word consisting of one-letter flags:
     #       'D' - The key has been disabled,
     #       'S' - The key is listed in sshcontrol (requires --with-ssh),
     #       'c' - Use of the key needs to be confirmed,
     #       '-' - No flags given.
-    flags = [DSc\-];
+    flags = [DSc\-]+ $flag;
 
-    # KEYINFO <keygrip> <type> <serialno> <idstr> - - <fpr> <ttl> <flags>
-    entry = 'S KEYINFO' space keygrip space type  space serialno space idstr space
-                              '-'     space '-'   space fpr      space ttl   space
-                              flags   newline @term;
+    # KEYINFO <keygrip> <type> <serialno> <idstr> <cached> <protection> <fpr> <ttl> <flags>
+    entry = 'S KEYINFO' space keygrip space type       space serialno space idstr space
+                              cached  space protection space fpr      space ttl   space
+                              flags   ( ' ' [^\n]* )? newline @term;
 
     main := ( entry | status )*;
 }%%
 
 %%write data;
 
-struct fingerprint_t *gpg_keyinfo(struct gpg_t *gpg)
+/* Run KEYINFO --list and hand every key to fn as it's parsed */
+static int gpg_keyinfo_foreach(struct gpg_t *gpg, void (*fn)(const struct keyinfo_t *key, void *arg),
+                               void *arg)
 {
     static const char message[] = "KEYINFO --list\n";
-    struct fingerprint_t *fpt = NULL;
-    char keygrip[40];
+    struct keyinfo_t key;
     size_t keylen = 0;
+    bool done = false;
+    int rc = 0;
 
     ssize_t nbytes_w = write(gpg->fd, message, sizeof(message) - 1);
     if (nbytes_w < 0)
-        return NULL;
+        return -errno;
 
     %%access gpg->;
     %%variable p gpg->p;
@@ -264,24 +469,81 @@ struct fingerprint_t *gpg_keyinfo(struct gpg_t *gpg)
     for (;;) {
         if (gpg->p == NULL || gpg->p == gpg->pe) {
             if (gpg_buffer_refill(gpg) <= 0)
-                break;
+                return -EIO;
         }
 
-        char *eof = gpg->pe;
         %%write exec;
 
         if (gpg->cs == keyinfo_error) {
             warnx("error parsing gpg protocol");
-            break;
+            return -EIO;
         }
+
+        if (done)
+            return rc;
     }
+}
+
+static void append_key(const struct keyinfo_t *key, void *arg)
+{
+    struct gpg_t *gpg = arg;
+
+    if (gpg->nkeys == gpg->keys_size) {
+        size_t size = gpg->keys_size ? 2 * gpg->keys_size : 16;
+        struct keyinfo_t *keys = realloc(gpg->keys, size * sizeof(struct keyinfo_t));
+        if (!keys)
+            return;
+
+        gpg->keys = keys;
+        gpg->keys_size = size;
+    }
+
+    gpg->keys[gpg->nkeys++] = *key;
+}
+
+/* The keys are kept in a single array owned by the connection, which is
+ * reused by the next call and released by gpg_close(). */
+const struct keyinfo_t *gpg_keyinfo(struct gpg_t *gpg, size_t *count)
+{
+    gpg->nkeys = 0;
+
+    if (gpg_keyinfo_foreach(gpg, append_key, gpg) < 0)
+        gpg->nkeys = 0;
 
-    return fpt;
+    *count = gpg->nkeys;
+    return gpg->keys;
+}
+
+static char *hex_encode(const char *str)
+{
+    static const char hex_digits[] = "0123456789ABCDEF";
+    size_t i, size = strlen(str);
+    char *hex = malloc(2 * size + 1);
+
+    if (!hex)
+        return NULL;
+
+    for (i = 0; i < size; i++) {
+        unsigned char c = str[i];
+
+        hex[2 * i] = hex_digits[c >> 4];
+        hex[2 * i + 1] = hex_digits[c & 0x0f];
+    }
+
+    hex[2 * size] = '\0';
+    return hex;
+}
+
+static void free_hex(char *hex)
+{
+    if (hex) {
+        explicit_bzero(hex, strlen(hex));
+        free(hex);
+    }
 }
 
 int gpg_preset_passphrase(struct gpg_t *gpg, const char *fingerprint, int timeout, const char *password)
 {
-    static const char *hex_digits = "0123456789ABCDEF";
     ssize_t nbytes_r;
     int rc;
 
@@ -291,38 +553,73 @@ int gpg_preset_passphrase(struct gpg_t *gpg, const char *fingerprint, int timeou
     if (!password) {
         nbytes_r = dprintf(gpg->fd, "PRESET_PASSPHRASE %s %d\n", fingerprint, timeout);
     } else {
-        size_t i, size = strlen(password);
-        char *bin_password = malloc(2 * size + 1);
-
-        for(i = 0; i < size; i++) {
-            bin_password[2 * i] = hex_digits[password[i] >> 4];
-            bin_password[2 * i + 1] = hex_digits[password[i] & 0x0f];
-        }
+        char *hex_password = hex_encode(password);
+        if (!hex_password)
+            return -ENOMEM;
 
-        bin_password[2 * size] = '\0';
-        nbytes_r = dprintf(gpg->fd, "PRESET_PASSPHRASE %s %d %s\n", fingerprint, timeout, bin_password);
-
-        free(bin_password);
+        nbytes_r = dprintf(gpg->fd, "PRESET_PASSPHRASE %s %d %s\n", fingerprint, timeout, hex_password);
+        free_hex(hex_password);
     }
 
     rc = gpg_check_return(gpg);
     return rc == 0 ? nbytes_r : -EIO;
 }
 
-void free_fingerprints(struct fingerprint_t *fpt)
+struct preset_t {
+    struct gpg_t *gpg;
+    int timeout;
+    char *hex_password;
+    int rc;
+};
+
+static void queue_preset(const struct keyinfo_t *key, void *arg)
+{
+    struct preset_t *preset = arg;
+
+    if (preset->rc < 0)
+        return;
+
+    if (preset->hex_password)
+        preset->rc = gpg_queue(preset->gpg, "PRESET_PASSPHRASE %.40s %d %s\n", key->keygrip,
+                               preset->timeout, preset->hex_password);
+    else
+        preset->rc = gpg_queue(preset->gpg, "PRESET_PASSPHRASE %.40s %d\n", key->keygrip,
+                               preset->timeout);
+}
+
+/* Preset the passphrase of every key gpg-agent knows about. Presets are
+ * queued straight from the KEYINFO listing as it's parsed, and then sent
+ * together. Returns the number of keys that couldn't be unlocked, or a
+ * negative errno. */
+int gpg_preset_passphrase_all(struct gpg_t *gpg, int timeout, const char *password)
 {
-    while (fpt) {
-        struct fingerprint_t *node = fpt;
-        fpt = fpt->next;
+    struct preset_t preset = { .gpg = gpg, .timeout = timeout };
+    int rc;
 
-        free(node->fingerprint);
-        free(node);
+    if (password) {
+        preset.hex_password = hex_encode(password);
+        if (!preset.hex_password)
+            return -ENOMEM;
     }
+
+    rc = gpg_keyinfo_foreach(gpg, queue_preset, &preset);
+    if (rc == 0 && preset.rc < 0)
+        rc = preset.rc;
+
+    if (rc == 0)
+        rc = gpg_flush(gpg, NULL);
+    else
+        gpg_discard(gpg);
+
+    free_hex(preset.hex_password);
+    return rc;
 }
 
 void gpg_close(struct gpg_t *gpg)
 {
     close(gpg->fd);
+    free(gpg->out);
+    free(gpg->keys);
     free(gpg);
 }
 
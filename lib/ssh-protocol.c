@@ -0,0 +1,462 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2013
+ */
+
+#include "ssh-protocol.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SSH_AGENT_FAILURE                5
+#define SSH_AGENTC_REQUEST_IDENTITIES   11
+#define SSH_AGENT_IDENTITIES_ANSWER     12
+
+/* same limit as OpenSSH's agent */
+#define SSH_AGENT_MAX_MSG (256 * 1024)
+
+static const char base64_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* read an ssh wire string, advancing *p past it */
+static const unsigned char *get_string(const unsigned char **p, const unsigned char *end, size_t *len)
+{
+    const unsigned char *str;
+
+    if (end - *p < 4)
+        return NULL;
+
+    *len = get_u32(*p);
+    str = *p + 4;
+    if ((size_t)(end - str) < *len)
+        return NULL;
+
+    *p = str + *len;
+    return str;
+}
+
+static int read_full(int fd, unsigned char *buf, size_t len)
+{
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t nbytes_r = read(fd, buf + total, len - total);
+        if (nbytes_r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        } else if (nbytes_r == 0) {
+            return -EPIPE;
+        }
+        total += nbytes_r;
+    }
+
+    return 0;
+}
+
+static int ssh_agent_connection(const char *sock, bool check, uid_t uid)
+{
+    union {
+        struct sockaddr sa;
+        struct sockaddr_un un;
+    } sa = { .un.sun_family = AF_UNIX };
+    size_t len = strlen(sock);
+
+    if (len >= sizeof(sa.un.sun_path))
+        return -ENAMETOOLONG;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    memcpy(sa.un.sun_path, sock, len);
+    if (connect(fd, &sa.sa, len + sizeof(sa.un.sun_family)) < 0) {
+        int rc = -errno;
+        close(fd);
+        return rc;
+    }
+
+    if (check) {
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != uid) {
+            close(fd);
+            return -EPERM;
+        }
+    }
+
+    return fd;
+}
+
+static int list_identities(const char *sock, bool check, uid_t uid, struct ssh_identities_t *ids)
+{
+    static const unsigned char request[] = { 0, 0, 0, 1, SSH_AGENTC_REQUEST_IDENTITIES };
+    const unsigned char *p, *end;
+    unsigned char hdr[4];
+    size_t i, len;
+    int rc;
+
+    *ids = (struct ssh_identities_t){ .count = 0 };
+
+    int fd = ssh_agent_connection(sock, check, uid);
+    if (fd < 0)
+        return fd;
+
+    if (write(fd, request, sizeof(request)) < 0) {
+        rc = -errno;
+        goto out;
+    }
+
+    rc = read_full(fd, hdr, sizeof(hdr));
+    if (rc < 0)
+        goto out;
+
+    len = get_u32(hdr);
+    if (len == 0 || len > SSH_AGENT_MAX_MSG) {
+        rc = -EBADMSG;
+        goto out;
+    }
+
+    ids->msg = malloc(len);
+    if (!ids->msg) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    rc = read_full(fd, ids->msg, len);
+    if (rc < 0)
+        goto out;
+
+    if (ids->msg[0] != SSH_AGENT_IDENTITIES_ANSWER || len < 5) {
+        rc = ids->msg[0] == SSH_AGENT_FAILURE ? -EPERM : -EBADMSG;
+        goto out;
+    }
+
+    p = &ids->msg[5];
+    end = &ids->msg[len];
+    ids->count = get_u32(&ids->msg[1]);
+
+    /* each identity takes at least two empty strings */
+    if (ids->count > (size_t)(end - p) / 8) {
+        rc = -EBADMSG;
+        goto out;
+    }
+
+    ids->keys = calloc(ids->count ? ids->count : 1, sizeof(struct ssh_identity_t));
+    if (!ids->keys) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < ids->count; ++i) {
+        struct ssh_identity_t *key = &ids->keys[i];
+
+        key->blob = get_string(&p, end, &key->blob_len);
+        key->comment = (const char *)get_string(&p, end, &key->comment_len);
+        if (!key->blob || !key->comment) {
+            rc = -EBADMSG;
+            goto out;
+        }
+    }
+
+out:
+    if (rc < 0)
+        ssh_free_identities(ids);
+    close(fd);
+    return rc;
+}
+
+int ssh_list_identities(const char *sock, struct ssh_identities_t *ids)
+{
+    return list_identities(sock, false, 0, ids);
+}
+
+int ssh_list_identities_owned(const char *sock, uid_t uid, struct ssh_identities_t *ids)
+{
+    return list_identities(sock, true, uid, ids);
+}
+
+bool ssh_has_identity(const struct ssh_identities_t *ids, const unsigned char *blob, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < ids->count; ++i) {
+        const struct ssh_identity_t *key = &ids->keys[i];
+
+        if (key->blob_len == len && memcmp(key->blob, blob, len) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+void ssh_free_identities(struct ssh_identities_t *ids)
+{
+    free(ids->keys);
+    free(ids->msg);
+    *ids = (struct ssh_identities_t){ .count = 0 };
+}
+
+static int base64_value(char c)
+{
+    const char *digit = c ? strchr(base64_digits, c) : NULL;
+    return digit ? digit - base64_digits : -1;
+}
+
+/* Load the key blob out of an OpenSSH public key file, which looks
+ * like "<type> <base64 blob> [comment]". */
+int ssh_load_pubkey(const char *path, unsigned char **blob, size_t *len)
+{
+    char *line = NULL, *encoded;
+    size_t n = 0, i;
+    uint32_t acc = 0;
+    int bits = 0, rc = 0;
+
+    FILE *fp = fopen(path, "re");
+    if (!fp)
+        return -errno;
+
+    if (getline(&line, &n, fp) < 0) {
+        rc = -EINVAL;
+        goto out;
+    }
+
+    encoded = strchr(line, ' ');
+    if (!encoded) {
+        rc = -EINVAL;
+        goto out;
+    }
+
+    encoded += 1;
+    encoded[strcspn(encoded, " \n")] = '\0';
+
+    *len = 0;
+    *blob = malloc(strlen(encoded) * 3 / 4 + 1);
+    if (!*blob) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; encoded[i] && encoded[i] != '='; ++i) {
+        int value = base64_value(encoded[i]);
+        if (value < 0) {
+            free(*blob);
+            rc = -EINVAL;
+            goto out;
+        }
+
+        acc = acc << 6 | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            (*blob)[(*len)++] = acc >> bits;
+        }
+    }
+
+out:
+    free(line);
+    fclose(fp);
+    return rc;
+}
+
+/* A compact SHA-256, enough to compute key fingerprints without
+ * pulling in libcrypto. */
+struct sha256_t {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char block[64];
+    size_t fill;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(struct sha256_t *ctx, const unsigned char *block)
+{
+    uint32_t w[64], v[8], t1, t2;
+    int i;
+
+    for (i = 0; i < 16; ++i)
+        w[i] = get_u32(&block[4 * i]);
+    for (; i < 64; ++i) {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(v, ctx->h, sizeof(v));
+    for (i = 0; i < 64; ++i) {
+        t1 = v[7] + (ROR(v[4], 6) ^ ROR(v[4], 11) ^ ROR(v[4], 25)) +
+             ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        t2 = (ROR(v[0], 2) ^ ROR(v[0], 13) ^ ROR(v[0], 22)) +
+             ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+        memmove(&v[1], &v[0], 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+
+    for (i = 0; i < 8; ++i)
+        ctx->h[i] += v[i];
+}
+
+static void sha256_update(struct sha256_t *ctx, const unsigned char *data, size_t len)
+{
+    ctx->len += len;
+
+    while (len) {
+        size_t n = sizeof(ctx->block) - ctx->fill;
+        if (n > len)
+            n = len;
+
+        memcpy(&ctx->block[ctx->fill], data, n);
+        ctx->fill += n;
+        data += n;
+        len -= n;
+
+        if (ctx->fill == sizeof(ctx->block)) {
+            sha256_block(ctx, ctx->block);
+            ctx->fill = 0;
+        }
+    }
+}
+
+static void sha256(const unsigned char *data, size_t len, unsigned char digest[32])
+{
+    struct sha256_t ctx = {
+        .h = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+               0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 }
+    };
+    unsigned char pad[72] = { 0x80 };
+    uint64_t bits;
+    size_t padlen;
+    int i;
+
+    sha256_update(&ctx, data, len);
+
+    bits = ctx.len * 8;
+    padlen = (ctx.fill < 56 ? 56 : 120) - ctx.fill;
+    for (i = 0; i < 8; ++i)
+        pad[padlen + i] = bits >> (56 - 8 * i);
+    sha256_update(&ctx, pad, padlen + 8);
+
+    for (i = 0; i < 32; ++i)
+        digest[i] = ctx.h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void ssh_fingerprint(const unsigned char *blob, size_t len, char out[SSH_FINGERPRINT_LEN + 1])
+{
+    unsigned char digest[32];
+    char *p = out + 7;
+    int i, bits = 0;
+    uint32_t acc = 0;
+
+    sha256(blob, len, digest);
+    memcpy(out, "SHA256:", 7);
+
+    for (i = 0; i < 32; ++i) {
+        acc = acc << 8 | digest[i];
+        for (bits += 8; bits >= 6; bits -= 6)
+            *p++ = base64_digits[(acc >> (bits - 6)) & 0x3f];
+    }
+    if (bits)
+        *p++ = base64_digits[(acc << (6 - bits)) & 0x3f];
+
+    *p = '\0';
+}
+
+/* Returns the size of the key in bits, the same figure ssh-add -l
+ * would show, and its type in *type. */
+int ssh_key_bits(const unsigned char *blob, size_t len, const char **type)
+{
+    static const struct {
+        const char *name;
+        const char *type;
+        int bits;
+    } fixed[] = {
+        { "ssh-ed25519",                        "ED25519",    256 },
+        { "sk-ssh-ed25519@openssh.com",         "ED25519-SK", 256 },
+        { "ecdsa-sha2-nistp256",                "ECDSA",      256 },
+        { "ecdsa-sha2-nistp384",                "ECDSA",      384 },
+        { "ecdsa-sha2-nistp521",                "ECDSA",      521 },
+        { "sk-ecdsa-sha2-nistp256@openssh.com", "ECDSA-SK",   256 },
+    };
+    const unsigned char *p = blob, *end = blob + len, *name, *mpint;
+    size_t i, name_len, mpint_len;
+
+    *type = "UNKNOWN";
+
+    name = get_string(&p, end, &name_len);
+    if (!name)
+        return 0;
+
+    for (i = 0; i < sizeof(fixed) / sizeof(fixed[0]); ++i) {
+        if (strlen(fixed[i].name) == name_len && memcmp(name, fixed[i].name, name_len) == 0) {
+            *type = fixed[i].type;
+            return fixed[i].bits;
+        }
+    }
+
+    /* rsa is "e" then "n", dsa leads with "p": measure the one we want */
+    if (name_len == 7 && memcmp(name, "ssh-rsa", 7) == 0) {
+        *type = "RSA";
+        if (!get_string(&p, end, &mpint_len))
+            return 0;
+    } else if (name_len == 7 && memcmp(name, "ssh-dss", 7) == 0) {
+        *type = "DSA";
+    } else {
+        return 0;
+    }
+
+    mpint = get_string(&p, end, &mpint_len);
+    if (!mpint)
+        return 0;
+
+    while (mpint_len && *mpint == 0) {
+        ++mpint;
+        --mpint_len;
+    }
+    if (!mpint_len)
+        return 0;
+
+    int bits = 8 * mpint_len;
+    for (unsigned char c = *mpint; !(c & 0x80); c <<= 1)
+        --bits;
+    return bits;
+}
+
+// vim: et:sts=4:sw=4:cino=(0
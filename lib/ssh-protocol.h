@@ -0,0 +1,56 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2013
+ */
+
+#ifndef SSH_PROTOCOL_H
+#define SSH_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* "SHA256:" followed by 43 characters of unpadded base64 */
+#define SSH_FINGERPRINT_LEN 51
+
+/* blob and comment point into the agent's reply, they're not copies */
+struct ssh_identity_t {
+    const unsigned char *blob;
+    size_t blob_len;
+    const char *comment;
+    size_t comment_len;
+};
+
+struct ssh_identities_t {
+    size_t count;
+    struct ssh_identity_t *keys;
+    unsigned char *msg;
+};
+
+int ssh_list_identities(const char *sock, struct ssh_identities_t *ids);
+
+/* Like ssh_list_identities(), but fails with -EPERM unless the agent
+ * on the other end runs as uid */
+int ssh_list_identities_owned(const char *sock, uid_t uid, struct ssh_identities_t *ids);
+bool ssh_has_identity(const struct ssh_identities_t *ids, const unsigned char *blob, size_t len);
+void ssh_free_identities(struct ssh_identities_t *ids);
+
+int ssh_load_pubkey(const char *path, unsigned char **blob, size_t *len);
+void ssh_fingerprint(const unsigned char *blob, size_t len, char out[SSH_FINGERPRINT_LEN + 1]);
+int ssh_key_bits(const unsigned char *blob, size_t len, const char **type);
+
+#endif
+
+// vim: et:sts=4:sw=4:cino=(0
@@ -38,6 +38,14 @@
 #define UNUSED           __attribute__((unused))
 #define PAM_LOG_ERR      LOG_AUTHPRIV | LOG_ERR
 #define PAM_LOG_WARN     LOG_AUTHPRIV | LOG_WARNING
+#define PAM_USER_DATA    "pam_envoy_user"
+
+struct pam_user_t {
+    uid_t uid;
+    gid_t gid;
+    char name[LOGIN_NAME_MAX];
+    char home[PATH_MAX];
+};
 
 static int __attribute__((format (printf, 2, 3))) pam_setenv(pam_handle_t *ph, const char *fmt, ...)
 {
@@ -57,6 +65,56 @@ static int __attribute__((format (printf, 2, 3))) pam_setenv(pam_handle_t *ph, c
     return 0;
 }
 
+static void free_user(pam_handle_t UNUSED *ph, void *data, int UNUSED error_status)
+{
+    free(data);
+}
+
+/* Authentication and the session usually share a handle, so the user is
+ * only looked up once per login. NSS can be slow when it's backed by a
+ * directory server. */
+static const struct pam_user_t *get_user(pam_handle_t *ph)
+{
+    const struct pam_user_t *cached;
+    struct pam_user_t *user;
+    const struct passwd *pwd;
+    const char *name;
+
+    int ret = pam_get_user(ph, &name, NULL);
+    if (ret != PAM_SUCCESS) {
+        syslog(PAM_LOG_ERR, "pam-envoy: couldn't get the user name: %s",
+               pam_strerror(ph, ret));
+        return NULL;
+    }
+
+    if (pam_get_data(ph, PAM_USER_DATA, (const void **)&cached) == PAM_SUCCESS &&
+        cached && strcmp(cached->name, name) == 0)
+        return cached;
+
+    pwd = getpwnam(name);
+    if (!pwd) {
+        syslog(PAM_LOG_ERR, "pam-envoy: error looking up user information: %s",
+               strerror(errno));
+        return NULL;
+    }
+
+    user = calloc(1, sizeof(struct pam_user_t));
+    if (!user)
+        return NULL;
+
+    user->uid = pwd->pw_uid;
+    user->gid = pwd->pw_gid;
+    snprintf(user->name, sizeof(user->name), "%s", name);
+    snprintf(user->home, sizeof(user->home), "%s", pwd->pw_dir ? pwd->pw_dir : "");
+
+    if (pam_set_data(ph, PAM_USER_DATA, user, free_user) != PAM_SUCCESS) {
+        free(user);
+        return NULL;
+    }
+
+    return user;
+}
+
 static int set_privileges(bool drop, uid_t *uid, gid_t *gid)
 {
     uid_t tmp_uid = geteuid();
@@ -78,28 +136,48 @@ static int set_privileges(bool drop, uid_t *uid, gid_t *gid)
     return true;
 }
 
-static int pam_get_agent(struct agent_data_t *data, enum agent id, uid_t uid, gid_t gid)
+static int check_agent(const struct agent_data_t *data)
 {
-    int ret = -1;
-    bool dropped = set_privileges(true, &uid, &gid);
-
-    ret = envoy_agent(data, id, true);
-    if (ret < 0)
-        syslog(PAM_LOG_ERR, "failed to fetch agent: %s", strerror(errno));
-
     switch (data->status) {
     case ENVOY_STOPPED:
         break;
     case ENVOY_STARTED:
     case ENVOY_RUNNING:
-        ret = 0;
-        break;
+        return 0;
     case ENVOY_FAILED:
         syslog(PAM_LOG_ERR, "agent failed to start, check envoyd's log");
     case ENVOY_BADUSER:
         syslog(PAM_LOG_ERR, "connection rejected, user is unauthorized to use this agent");
+        break;
+    case ENVOY_BADCONFIG:
+        syslog(PAM_LOG_ERR, "agent definitions differ from envoyd's, restart it after changing agents.conf");
     }
 
+    return -1;
+}
+
+/* With more than one agent in mask, data is indexed by agent type and
+ * id is the one whose result is returned */
+static int pam_get_agent(struct agent_data_t *data, enum agent id, unsigned mask,
+                         uid_t uid, gid_t gid, bool prestart)
+{
+    int ret = -1;
+    bool dropped = set_privileges(true, &uid, &gid);
+
+    if (mask & (mask - 1))
+        ret = prestart ? envoy_prestart_agents(data, mask) : envoy_agents(data, mask, true);
+    else
+        ret = prestart ? envoy_prestart(data, id) : envoy_agent(data, id, true);
+
+    if (ret == -ETIMEDOUT)
+        syslog(PAM_LOG_ERR, "timed out waiting for envoyd");
+    else if (ret < 0)
+        syslog(PAM_LOG_ERR, "failed to fetch agent: %s", strerror(-ret));
+    else if (mask & (mask - 1))
+        ret = check_agent(&data[id]);
+    else
+        ret = check_agent(data);
+
     if (dropped) {
         set_privileges(false, &uid, &gid);
     }
@@ -107,53 +185,87 @@ static int pam_get_agent(struct agent_data_t *data, enum agent id, uid_t uid, gi
     return ret;
 }
 
+static void pam_export_agent(pam_handle_t *ph, const struct agent_data_t *data,
+                             const struct pam_user_t *user)
+{
+    /* gpg-agent 2.1 and later print no GPG_AGENT_INFO */
+    if (data->type == AGENT_GPG_AGENT && data->gpg[0]) {
+        struct gpg_t *agent = gpg_agent_connection(data->gpg);
+
+        if (agent) {
+            gpg_update_tty(agent, data->home[0] ? data->home : user->home);
+            gpg_close(agent);
+        }
+
+        pam_setenv(ph, "GPG_AGENT_INFO=%s", data->gpg);
+    }
+
+    pam_setenv(ph, "SSH_AUTH_SOCK=%s", data->sock);
+    if (data->pid)
+        pam_setenv(ph, "SSH_AGENT_PID=%d", data->pid);
+}
+
 /* PAM entry point for session creation */
 PAM_EXTERN int pam_sm_open_session(pam_handle_t *ph, int UNUSED flags,
                                    int argc, const char **argv)
 {
-    struct agent_data_t data;
-    const struct passwd *pwd;
-    const char *user;
-    enum agent id = AGENT_DEFAULT;
-    int ret;
-
-    ret = pam_get_user(ph, &user, NULL);
-    if (ret != PAM_SUCCESS) {
-        syslog(PAM_LOG_ERR, "pam-envoy: couldn't get the user name: %s",
-               pam_strerror(ph, ret));
+    struct agent_data_t agents[AGENT_MAX], *data = agents;
+    const struct pam_user_t *user;
+    enum agent id = AGENT_DEFAULT, type;
+    unsigned mask = 0;
+    bool prestart = false;
+    int i;
+
+    user = get_user(ph);
+    if (!user)
         return PAM_SERVICE_ERR;
-    }
 
-    pwd = getpwnam(user);
-    if (!pwd) {
-        syslog(PAM_LOG_ERR, "pam-envoy: error looking up user information: %s",
-               strerror(errno));
-        return PAM_SERVICE_ERR;
-    }
+    /* su runs this elevated, so the user's environment doesn't get to
+     * point it at some other file */
+    if (load_agents(ENVOY_AGENTS_PATH) < 0)
+        syslog(PAM_LOG_WARN, "pam-envoy: failed to read agent definitions");
 
-    if (argc > 1) {
-        syslog(PAM_LOG_WARN, "pam-envoy: too many arguments");
-        return PAM_SUCCESS;
-    } else if (argc == 1) {
-        id = lookup_agent(argv[0]);
+    /* every agent named is fetched, the first one's SSH_AUTH_SOCK wins */
+    for (i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "prestart") == 0) {
+            prestart = true;
+            continue;
+        }
+
+        type = lookup_agent(argv[i]);
+        if (type == AGENT_MAX) {
+            syslog(PAM_LOG_WARN, "pam-envoy: unknown agent: %s", argv[i]);
+            return PAM_SUCCESS;
+        }
+
+        if (id == AGENT_DEFAULT)
+            id = type;
+        mask |= ENVOY_AGENT_BIT(type);
     }
 
-    if (pam_get_agent(&data, id, pwd->pw_uid, pwd->pw_gid) < 0) {
+    bool batch = mask & (mask - 1);
+    if (batch)
+        data = &agents[id];
+
+    if (pam_get_agent(agents, id, mask, user->uid, user->gid, prestart) < 0) {
         syslog(PAM_LOG_WARN, "pam-envoy: failed to get agent for user");
         return PAM_SUCCESS;
     }
 
-    if (data.type == AGENT_GPG_AGENT) {
-        struct gpg_t *agent = gpg_agent_connection(data.gpg);
-        gpg_update_tty(agent);
-        gpg_close(agent);
+    for (type = 0; batch && type < agent_count; ++type) {
+        const struct agent_data_t *other = &agents[type];
 
-        pam_setenv(ph, "GPG_AGENT_INFO=%s", data.gpg);
+        if (type == id || !(mask & ENVOY_AGENT_BIT(type)) || check_agent(other) < 0)
+            continue;
+        if (!prestart || other->sock[0] || other->gpg[0])
+            pam_export_agent(ph, other, user);
     }
 
-    pam_setenv(ph, "SSH_AUTH_SOCK=%s", data.sock);
-    pam_setenv(ph, "SSH_AGENT_PID=%d", data.pid);
+    /* the agent is still starting, the environment comes from envoy later */
+    if (prestart && !data->sock[0] && !data->gpg[0])
+        return PAM_SUCCESS;
 
+    pam_export_agent(ph, data, user);
     return PAM_SUCCESS;
 }
 
@@ -169,24 +281,14 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t UNUSED *ph, int UNUSED flags,
                                    int UNUSED argc, const char UNUSED **argv)
 {
     struct agent_data_t data;
-    const struct passwd *pwd;
-    const char *user, *password;
+    const struct pam_user_t *user;
+    const char *password;
     enum agent id = AGENT_DEFAULT;
     int ret;
 
-    ret = pam_get_user(ph, &user, NULL);
-    if (ret != PAM_SUCCESS) {
-        syslog(PAM_LOG_ERR, "pam-envoy: couldn't get the user name: %s",
-               pam_strerror(ph, ret));
+    user = get_user(ph);
+    if (!user)
         return PAM_SERVICE_ERR;
-    }
-
-    pwd = getpwnam(user);
-    if (!pwd) {
-        syslog(PAM_LOG_ERR, "pam-envoy: error looking up user information: %s",
-               strerror(errno));
-        return PAM_SERVICE_ERR;
-    }
 
     /* Look up the password */
     ret = pam_get_item(ph, PAM_AUTHTOK, (const void**)&password);
@@ -199,23 +301,24 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t UNUSED *ph, int UNUSED flags,
         return PAM_SUCCESS;
     }
 
-    if (pam_get_agent(&data, id, pwd->pw_uid, pwd->pw_gid) < 0) {
+    if (pam_get_agent(&data, id, 0, user->uid, user->gid, false) < 0) {
         syslog(PAM_LOG_WARN, "pam-envoy: failed to get agent for user");
         return PAM_SUCCESS;
     }
 
-    if (data.status == ENVOY_RUNNING && data.type == AGENT_GPG_AGENT) {
+    if (data.status == ENVOY_RUNNING && data.type == AGENT_GPG_AGENT && data.gpg[0]) {
         struct gpg_t *agent = gpg_agent_connection(data.gpg);
 
-        if (password) {
-            const struct fingerprint_t *fpt = gpg_keyinfo(agent);
-            for (; fpt; fpt = fpt->next) {
-                if (gpg_preset_passphrase(agent, fpt->fingerprint, -1, password) < 0)
-                    syslog(PAM_LOG_ERR, "failed to unlock '%s'", fpt->fingerprint);
-            }
+        if (agent && password) {
+            ret = gpg_preset_passphrase_all(agent, -1, password);
+            if (ret < 0)
+                syslog(PAM_LOG_ERR, "failed to unlock keys: %s", strerror(-ret));
+            else if (ret > 0)
+                syslog(PAM_LOG_ERR, "failed to unlock %d keys", ret);
         }
 
-        gpg_close(agent);
+        if (agent)
+            gpg_close(agent);
     }
 
     return PAM_SUCCESS;
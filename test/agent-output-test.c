@@ -0,0 +1,143 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2013
+ */
+
+/* Feeds the agent output parser what the built-in agents really print,
+ * whole and a byte at a time, and checks when envoyd would answer. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lib/envoy.h"
+#include "lib/agent-output.h"
+
+struct output_t {
+    const char *name;
+    enum agent type;
+    const char *text;
+    const char *sock;
+    pid_t pid;
+    const char *gpg;
+};
+
+static const struct output_t outputs[] = {
+    {
+        .name = "ssh-agent",
+        .type = AGENT_SSH_AGENT,
+        .text = "SSH_AUTH_SOCK=/tmp/ssh-XXXXXXd8cJcv/agent.4211; export SSH_AUTH_SOCK;\n"
+                "SSH_AGENT_PID=4212; export SSH_AGENT_PID;\n"
+                "echo Agent pid 4212;\n",
+        .sock = "/tmp/ssh-XXXXXXd8cJcv/agent.4211",
+        .pid = 4212,
+        .gpg = ""
+    },
+    {
+        .name = "ssh-agent -c",
+        .type = AGENT_SSH_AGENT,
+        .text = "setenv SSH_AUTH_SOCK /tmp/ssh-XXXXXXd8cJcv/agent.4211;\n"
+                "setenv SSH_AGENT_PID 4212;\n"
+                "echo Agent pid 4212;\n",
+        .sock = "/tmp/ssh-XXXXXXd8cJcv/agent.4211",
+        .pid = 4212,
+        .gpg = ""
+    },
+    {
+        .name = "gpg-agent 2.0",
+        .type = AGENT_GPG_AGENT,
+        .text = "GPG_AGENT_INFO=/tmp/gpg-2Yvvsz/S.gpg-agent:4301:1; export GPG_AGENT_INFO;\n"
+                "SSH_AUTH_SOCK=/tmp/gpg-2Yvvsz/S.gpg-agent.ssh; export SSH_AUTH_SOCK;\n"
+                "SSH_AGENT_PID=4301; export SSH_AGENT_PID;\n",
+        .sock = "/tmp/gpg-2Yvvsz/S.gpg-agent.ssh",
+        .pid = 4301,
+        .gpg = "/tmp/gpg-2Yvvsz/S.gpg-agent:4301:1"
+    },
+    {
+        .name = "gpg-agent 2.1",
+        .type = AGENT_GPG_AGENT,
+        .text = "SSH_AUTH_SOCK=/run/user/1000/gnupg/S.gpg-agent.ssh; export SSH_AUTH_SOCK;\n",
+        .sock = "/run/user/1000/gnupg/S.gpg-agent.ssh",
+        .pid = 0,
+        .gpg = ""
+    },
+    {
+        .name = "gpg-agent 2.1, no newline",
+        .type = AGENT_GPG_AGENT,
+        .text = "SSH_AUTH_SOCK=/run/user/1000/gnupg/S.gpg-agent.ssh; export SSH_AUTH_SOCK;",
+        .sock = "/run/user/1000/gnupg/S.gpg-agent.ssh",
+        .pid = 0,
+        .gpg = ""
+    }
+};
+
+static bool check(const struct output_t *out, bool bytewise)
+{
+    const struct agent_t *agent = Agent[out->type];
+    struct agent_data_t data = { .type = out->type };
+    struct agent_output_t parser;
+    size_t i, len = strlen(out->text), step = bytewise ? 1 : len;
+    const char *mode = bytewise ? "bytewise" : "whole";
+    bool ok = true;
+
+    agent_output_init(&parser, agent);
+    for (i = 0; i < len; i += step) {
+        /* envoyd answers as soon as this says so, it must not be early */
+        if (agent_output_ready(agent, &data) &&
+            (strcmp(data.sock, out->sock) != 0 || data.pid != out->pid)) {
+            printf("FAIL %s (%s): ready before the socket and pid were seen\n", out->name, mode);
+            ok = false;
+        }
+        agent_output_feed(&parser, &out->text[i], step, &data);
+    }
+    agent_output_finish(&parser, &data);
+
+    if (strcmp(data.sock, out->sock) != 0) {
+        printf("FAIL %s (%s): socket is '%s'\n", out->name, mode, data.sock);
+        ok = false;
+    }
+    if (data.pid != out->pid) {
+        printf("FAIL %s (%s): pid is %d\n", out->name, mode, data.pid);
+        ok = false;
+    }
+    if (strcmp(data.gpg, out->gpg) != 0) {
+        printf("FAIL %s (%s): GPG_AGENT_INFO is '%s'\n", out->name, mode, data.gpg);
+        ok = false;
+    }
+    if (!agent_output_ready(agent, &data)) {
+        printf("FAIL %s (%s): never ready\n", out->name, mode);
+        ok = false;
+    }
+
+    if (ok)
+        printf("ok   %s (%s)\n", out->name, mode);
+    return ok;
+}
+
+int main(void)
+{
+    size_t i;
+    bool ok = true;
+
+    for (i = 0; i < sizeof(outputs) / sizeof(outputs[0]); ++i) {
+        ok &= check(&outputs[i], false);
+        ok &= check(&outputs[i], true);
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// vim: et:sts=4:sw=4:cino=(0